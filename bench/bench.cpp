@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "gi.h"
+
+// micro-benchmarks of the hot paths, run with "make bench". rays and samples are traced on a single thread from input
+// generated with a fixed seed and the fastest of a few repetitions is reported, so runs of different versions or build
+// flags, e.g. EMBREE=1, can be compared by the name of the benchmark. the checksums tell whether both did the same work
+
+constexpr unsigned SEED = 1234;
+constexpr int NUM_REPETITIONS = 5;
+constexpr int NUM_RAYS = 1 << 18;
+constexpr int NUM_SAMPLES = 1 << 20;
+constexpr int MESH_RES = 200; // the benchmark mesh has 2*MESH_RES^2 triangles
+
+struct BenchResult {
+    std::string name;
+    double seconds;
+    long items;
+    double checksum;
+};
+
+static std::vector<BenchResult> results;
+
+// setup runs before every repetition and is not timed, f returns a checksum of its work
+static void Run(const std::string& name, long items, std::function<void()> setup, std::function<double()> f)
+{
+    double best = M_INF, checksum = 0;
+    for(int i = 0; i < NUM_REPETITIONS; ++i) {
+        setup();
+        SeedRandom(SEED);
+        double t1 = TimeNow();
+        checksum = f();
+        best = Min(best, TimeNow() - t1);
+    }
+    results.push_back({ name, best, items, checksum });
+    printf("%-32s %10.3f ms %10.3f M/s   checksum %.6g\n", name.c_str(), 1e3*best, items / (1e6*best), checksum);
+}
+
+static void Run(const std::string& name, long items, std::function<double()> f)
+{
+    Run(name, items, [](){}, f);
+}
+
+static bool WriteJSON(const char* filename)
+{
+    FILE* f = fopen(filename, "w");
+    if(!f) return false;
+#ifdef EMBREE
+    const char* embree = "true";
+#else
+    const char* embree = "false";
+#endif
+#ifdef SINGLE_PRECISION
+    const char* single_precision = "true";
+#else
+    const char* single_precision = "false";
+#endif
+    fprintf(f, "{\"config\": {\"embree\": %s, \"single_precision\": %s, \"seed\": %u, \"repetitions\": %d},\n",
+            embree, single_precision, SEED, NUM_REPETITIONS);
+    fprintf(f, " \"results\": [\n");
+    for(unsigned i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        fprintf(f, "  {\"name\": \"%s\", \"seconds\": %.9f, \"items\": %ld, \"mitems_per_second\": %.6f, \"checksum\": %.17g}%s\n",
+                r.name.c_str(), r.seconds, r.items, r.items / (1e6*r.seconds), r.checksum, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, " ]}\n");
+    fclose(f);
+    return true;
+}
+
+// a sphere with bumps, so that the tree has some work to do
+static std::vector<Vec3> BumpySphere(int res)
+{
+    auto P = [res](int i, int j) {
+        double theta = M_PI*i/res, phi = 2*M_PI*j/res;
+        double r = 1.0 + 0.1*sin(7*theta)*sin(9*phi);
+        return Vec3(r*sin(theta)*cos(phi), r*sin(theta)*sin(phi), r*cos(theta));
+    };
+    std::vector<Vec3> positions;
+    for(int i = 0; i < res; ++i) {
+        for(int j = 0; j < res; ++j) {
+            Vec3 a = P(i, j), b = P(i+1, j), c = P(i+1, j+1), d = P(i, j+1);
+            positions.insert(positions.end(), { a, b, c, a, c, d });
+        }
+    }
+    return positions;
+}
+
+// neighbouring rays of a pinhole camera in scanline order
+static std::vector<Ray> CoherentRays(const Vec3& from, const Vec3& at)
+{
+    int res = int(sqrt(double(NUM_RAYS)));
+    Camera cam(from, at, {0,0,1}, 45.0, 1.0);
+    std::vector<Ray> rays;
+    for(int y = 0; y < res; ++y) {
+        for(int x = 0; x < res; ++x) rays.push_back(cam.CastRay((x + 0.5) / res, (y + 0.5) / res));
+    }
+    return rays;
+}
+
+// rays from random points around the box through random points inside of it
+static std::vector<Ray> IncoherentRays(const BBox& box)
+{
+    SeedRandom(SEED);
+    Vec3 centre = box.Anchor(Vec3(0.5)), size = box.Size();
+    double radius = 2.0*size.MaxComponent();
+    std::vector<Ray> rays;
+    for(int i = 0; i < NUM_RAYS; ++i) {
+        Vec3 from = centre + RandomInUnitSphere()*radius;
+        Vec3 to = box.Anchor(Vec3(RandomUniform(), RandomUniform(), RandomUniform()));
+        rays.push_back(Ray(from, Normalized(to - from)));
+    }
+    return rays;
+}
+
+static double ClosestHits(const Surface* s, const std::vector<Ray>& rays)
+{
+    double sum = 0;
+    for(const Ray& r : rays) {
+        Hit h;
+        if(s->Intersect(r, &h)) sum += h.t;
+    }
+    return sum;
+}
+
+static double AnyHits(const Surface* s, const std::vector<Ray>& rays)
+{
+    double count = 0;
+    for(const Ray& r : rays) count += s->Occludes(r, M_INF);
+    return count;
+}
+
+// builds and traces the mesh with the backend set up by configure, the results are labeled by the backend name
+static void BenchMeshBackend(const std::string& backend, const std::vector<Vec3>& positions, Material* material,
+                             const std::vector<Ray>& coherent, const std::vector<Ray>& incoherent,
+                             std::function<void(Mesh*)> configure)
+{
+    std::unique_ptr<Mesh> mesh;
+    auto setup = [&]() {
+        mesh = std::make_unique<Mesh>(positions, material);
+        configure(mesh.get());
+    };
+    Run("build/" + backend, positions.size() / 3, setup, [&]() { mesh->Build(); return 0.0; });
+    Run("closest/coherent/" + backend, NUM_RAYS, [&]() { return ClosestHits(mesh.get(), coherent); });
+    Run("closest/incoherent/" + backend, NUM_RAYS, [&]() { return ClosestHits(mesh.get(), incoherent); });
+    Run("any/coherent/" + backend, NUM_RAYS, [&]() { return AnyHits(mesh.get(), coherent); });
+    Run("any/incoherent/" + backend, NUM_RAYS, [&]() { return AnyHits(mesh.get(), incoherent); });
+}
+
+static void BenchMesh()
+{
+    std::vector<Vec3> positions = BumpySphere(MESH_RES);
+    Lambertian material(Vec3(0.5));
+    std::vector<Ray> coherent = CoherentRays({0,-3,0.5}, {0,0,0});
+    std::vector<Ray> incoherent = IncoherentRays(BBox(Vec3(-1.1), Vec3(1.1)));
+#ifdef EMBREE
+    // meshes are traced by embree and build none of the mesh accelerators
+    BenchMeshBackend("embree", positions, &material, coherent, incoherent, [](Mesh*) {});
+#else
+    std::vector<std::pair<AcceleratorType, std::string>> accelerators = {
+        { AcceleratorType::KDTREE, "kdtree" }, { AcceleratorType::BVH, "bvh" }, { AcceleratorType::BVH4, "bvh4" },
+    };
+    for(const auto& accel : accelerators) {
+        AcceleratorType type = accel.first;
+        BenchMeshBackend(accel.second, positions, &material, coherent, incoherent, [type](Mesh* mesh) { mesh->SetAccelerator(type); });
+    }
+#endif
+}
+
+static void BenchPrimitives()
+{
+    // a single triangle goes through the same block test the meshes use
+    Lambertian material(Vec3(0.5));
+    Mesh triangle({ Vec3(-1,0,-1), Vec3(1,0,-1), Vec3(0,0,1) }, &material);
+    TriangleBlocks block(&triangle);
+    block.Assign({ 0, -1, -1, -1 });
+    std::vector<Ray> rays = IncoherentRays(BBox(Vec3(-1.5), Vec3(1.5)));
+    Run("intersect/triangle", NUM_RAYS, [&]() {
+        double sum = 0;
+        for(const Ray& r : rays) {
+            Hit h;
+            if(block.Intersect(0, r, &h)) sum += h.t;
+        }
+        return sum;
+    });
+
+    Sphere sphere(Vec3(0), 1, std::make_shared<Lambertian>(Vec3(0.5)));
+    Run("intersect/sphere", NUM_RAYS, [&]() { return ClosestHits(&sphere, rays); });
+}
+
+static void BenchMaterials()
+{
+    auto glossy = std::make_shared<PowerCosineDistribution>(100);
+    std::vector<std::pair<std::string, std::shared_ptr<Material>>> materials = {
+        { "lambertian", std::make_shared<Lambertian>(Vec3(0.5)) },
+        { "oren_nayar", std::make_shared<OrenNayar>(Vec3(0.5)) },
+        { "dielectric", std::make_shared<Dielectric>(1.5) },
+        { "microfacet", std::make_shared<Microfacet>(Vec3(0.5), glossy, 2.0) },
+        { "fresnel_blend", std::make_shared<FresnelBlend>(Vec3(0.5), Vec3(0.5), glossy) },
+    };
+    SeedRandom(SEED);
+    std::vector<Vec3> wo(NUM_SAMPLES), wi(NUM_SAMPLES);
+    for(int i = 0; i < NUM_SAMPLES; ++i) wo[i] = CosineSampleHemisphere(), wi[i] = CosineSampleHemisphere();
+    HitRecord hr = { 1.0, Vec3(0), Vec3(0,0,1), 0.5, 0.5, nullptr };
+    for(const auto& m : materials) {
+        const Material* material = m.second.get();
+        Run("sample/" + m.first, NUM_SAMPLES, [&]() {
+            double sum = 0;
+            bool is_specular;
+            for(const Vec3& w : wo) sum += material->Sample(w, &is_specular).z;
+            return sum;
+        });
+        Run("eval/" + m.first, NUM_SAMPLES, [&]() {
+            double sum = 0;
+            for(int i = 0; i < NUM_SAMPLES; ++i) sum += material->Eval(wo[i], wi[i], hr).x;
+            return sum;
+        });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    BenchMesh();
+    BenchPrimitives();
+    BenchMaterials();
+    if(argc > 1) {
+        if(!WriteJSON(argv[1])) {
+            fprintf(stderr, "Cannot write \"%s\"\n", argv[1]);
+            return 1;
+        }
+        printf("results written to %s\n", argv[1]);
+    }
+    return 0;
+}
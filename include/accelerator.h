@@ -0,0 +1,67 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "bbox.h"
+#include "surface.h"
+#include "triangle_block.h"
+#include "utils.h"
+
+#include <vector>
+#include <memory>
+
+struct KDBuildParams;
+struct BinaryWriter;
+struct BinaryReader;
+
+enum class AcceleratorType : int { KDTREE, BVH, BVH4, };
+
+// the primitives an accelerator is built over, either surfaces or the triangle blocks of a mesh. the blocks are tested
+// directly instead of through a virtual call per block
+class PrimitiveSet {
+private:
+    std::vector<Surface*> surfaces;
+    const TriangleBlocks* blocks;
+public:
+    PrimitiveSet() : blocks(nullptr) {}
+    PrimitiveSet(const std::vector<Surface*>& surfaces) : surfaces(surfaces), blocks(nullptr) {}
+    PrimitiveSet(const TriangleBlocks* blocks) : blocks(blocks) {}
+
+    inline int Size() const { return this->blocks ? this->blocks->Size() : int(this->surfaces.size()); }
+    inline BBox Bounds(int i) const { return this->blocks ? this->blocks->Bounds(i) : this->surfaces[i]->GetBBox(); }
+    inline bool Intersect(int i, const Ray& r, Hit* h) const
+    {
+        return this->blocks ? this->blocks->Intersect(i, r, h) : this->surfaces[i]->Intersect(r, h);
+    }
+    inline bool Occludes(int i, const Ray& r, double tmax) const
+    {
+        return this->blocks ? this->blocks->Occludes(i, r, tmax) : this->surfaces[i]->Occludes(r, tmax);
+    }
+    inline void IntersectPacket(int i, const RayPacket& p, Hit* hits, unsigned mask) const
+    {
+        if(this->blocks) this->blocks->IntersectPacket(i, p, hits, mask);
+        else this->surfaces[i]->IntersectPacket(p, hits, mask);
+    }
+};
+
+// spatial acceleration structure over a set of primitives
+class Accelerator {
+public:
+    virtual bool Intersect(const Ray& r, Hit* h) const = 0;
+    virtual bool IntersectAny(const Ray& r, double tmax=M_INF) const = 0; // true if anything is hit in (M_EPS, tmax)
+    // closest hits of the active rays of the packet, traced one by one unless the accelerator supports packets
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const;
+    virtual BBox GetBBox() const = 0;
+    // updates the structure in place after the surfaces moved. returns false if it has to be rebuilt instead,
+    // either because it cannot be refit, like the k-d tree whose split planes depend on the geometry, or because
+    // the refit structure has become too inefficient
+    virtual bool Refit() { return false; }
+    virtual void Save(BinaryWriter* writer) const = 0; // writes the built structure, read back by LoadAccelerator
+    virtual ~Accelerator() {}
+};
+
+// the k-d tree parameters are ignored by the other accelerators
+std::unique_ptr<Accelerator> BuildAccelerator(AcceleratorType type, const PrimitiveSet& primitives, const KDBuildParams& kd_params);
+// reads an accelerator of the given type over the same primitives back, returns nullptr if the data is invalid
+std::unique_ptr<Accelerator> LoadAccelerator(AcceleratorType type, const PrimitiveSet& primitives, BinaryReader* reader);
+
+#endif
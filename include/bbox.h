@@ -8,7 +8,6 @@
 #include <memory>
 
 struct Ray;
-class Surface;
 
 // Axis Aligned Bounding Box
 struct BBox {
@@ -21,6 +20,7 @@ struct BBox {
     BBox Union(const BBox& b) const;
     bool Contains(const Vec3& p) const;
     bool Intersects(const BBox& b)  const;
+    bool Unbounded() const; // extends to infinity along some axis, e.g. the box of a plane
     bool Intersect(const Ray& r, double* t1, double* t2) const;
     Vec3 Size() const;
     void Partition(Axis axis, double p, bool* left, bool* right) const;
@@ -28,6 +28,23 @@ struct BBox {
     Vec3 Anchor(const Vec3& anchor) const;
 };
 
-BBox SurroundingBBox(const std::vector<Surface*>& surfaces);
+// single precision box, rounded outward so it still contains the box it was made from
+struct BBoxf {
+    Vec3f min_point;
+    Vec3f max_point;
+
+    BBoxf() = default;
+    BBoxf(const BBox& b);
+    operator BBox() const { return { min_point, max_point }; }
+};
+
+// storage type of the bounds kept per primitive or node, single precision when built with SINGLE_PRECISION=1
+#ifdef SINGLE_PRECISION
+typedef BBoxf GeometryBBox;
+#else
+typedef BBox GeometryBBox;
+#endif
+
+BBox SurroundingBBox(const std::vector<BBox>& boxes);
 
 #endif
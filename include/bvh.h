@@ -0,0 +1,72 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "accelerator.h"
+#include "bbox.h"
+#include "utils.h"
+
+#include <vector>
+#include <stdint.h>
+
+struct Hit;
+struct TraversalCounter;
+
+constexpr int BVH_NUM_BINS = 16; // candidate split planes per axis
+constexpr int BVH_MAX_LEAF_SIZE = 8;
+constexpr double BVH_TRAVERSAL_COST = 0.125; // relative to the cost of intersecting a single primitive
+constexpr int BVH_MAX_DEPTH = 64; // also the size of the traversal stack
+constexpr double BVH_MAX_REFIT_COST = 1.5; // rebuild once refitting made the tree this much more expensive than when built
+
+// node of the bvh during construction, covers primitives [begin, end) of the primitive index array
+struct BVHNode {
+    BBox bounds;
+    int begin, end;
+    Axis axis;
+    std::unique_ptr<BVHNode> left, right;
+
+    BVHNode(int begin, int end) : begin(begin), end(end), axis(Axis::NONE), left(nullptr), right(nullptr) { }
+
+    void Split(const std::vector<BBox>& boxes, const std::vector<Vec3>& centroids, std::vector<int>* indices, int depth);
+    int NumNodes() const { return 1 + (this->left ? this->left->NumNodes() + this->right->NumNodes() : 0); }
+};
+
+// builds the binary hierarchy over the primitives and fills indices with the primitive order of its leaves
+std::unique_ptr<BVHNode> BuildBVHNodes(const PrimitiveSet& primitives, std::vector<int>* indices);
+std::unique_ptr<BVHNode> BuildBVHNodes(const std::vector<BBox>& boxes, std::vector<int>* indices);
+
+// node of the flattened bvh. interior nodes store the index of their second child, the first one directly follows
+// its parent. leaves store an offset into the primitive index array of the tree
+struct BVHFlatNode {
+    GeometryBBox bounds;
+    uint32_t offset; // primitive offset for leaves, second child index for interior nodes
+    uint16_t num_primitives; // 0 for interior nodes
+    uint8_t axis; // split axis of interior nodes, used to visit the nearest child first
+
+    inline bool IsLeaf() const { return num_primitives > 0; }
+};
+
+// bounding volume hierarchy built with a binned surface area heuristic
+class BVH : public Accelerator {
+private:
+    std::vector<BVHFlatNode> nodes;
+    std::vector<int> indices; // primitive indices of all leaves
+    PrimitiveSet primitives;
+    double build_cost;
+
+    BVH() = default; // empty hierarchy, filled by Load
+    void Flatten(const BVHNode* node);
+    double Cost() const;
+    template<typename LeafFunc> void Traverse(const Ray& r, double tlimit, TraversalCounter* counter, LeafFunc intersect_leaf) const;
+
+public:
+    BVH(const PrimitiveSet& primitives);
+    virtual bool Intersect(const Ray& r, Hit* h) const;
+    virtual bool IntersectAny(const Ray& r, double tmax=M_INF) const;
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const;
+    virtual BBox GetBBox() const;
+    virtual bool Refit();
+    virtual void Save(BinaryWriter* writer) const;
+    static std::unique_ptr<BVH> Load(const PrimitiveSet& primitives, BinaryReader* reader);
+};
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef BVH4_H
+#define BVH4_H
+
+#include "accelerator.h"
+#include "bvh.h"
+#include "bbox.h"
+#include "utils.h"
+
+#include <vector>
+#include <stdint.h>
+
+struct Hit;
+struct TraversalCounter;
+
+constexpr int BVH4_STACK_SIZE = 3*BVH_MAX_DEPTH + 1; // every visited node replaces itself with at most four children
+
+// 128 byte node of the 4-wide bvh. the child bounds are stored as structure of arrays in single precision,
+// so that a ray can be tested against all four boxes at once. children with num_primitives > 0 are leaves,
+// the others are interior nodes, and unused children are marked with a negative index
+struct alignas(16) BVH4Node {
+    float min_x[4], min_y[4], min_z[4];
+    float max_x[4], max_y[4], max_z[4];
+    int32_t children[4]; // node index for interior children, primitive offset for leaves
+    uint32_t num_primitives[4];
+
+    void SetChild(int i, const BBox& bounds, int32_t child, uint32_t num_primitives);
+    void SetEmpty(int i);
+    BBox ChildBounds(int i) const;
+};
+
+// bounding volume hierarchy with four children per node, collapsed from the binary SAH hierarchy
+class BVH4 : public Accelerator {
+private:
+    BBox bbox;
+    std::vector<BVH4Node> nodes;
+    std::vector<int> indices; // primitive indices of all leaves
+    PrimitiveSet primitives;
+    double build_cost;
+
+    BVH4() = default; // empty hierarchy, filled by Load
+    int Collapse(const BVHNode* node);
+    double Cost() const;
+    template<typename LeafFunc> void Traverse(const Ray& r, double tlimit, TraversalCounter* counter, LeafFunc intersect_leaf) const;
+
+public:
+    BVH4(const PrimitiveSet& primitives);
+    virtual bool Intersect(const Ray& r, Hit* h) const;
+    virtual bool IntersectAny(const Ray& r, double tmax=M_INF) const;
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const;
+    virtual BBox GetBBox() const { return this->bbox; }
+    virtual bool Refit();
+    virtual void Save(BinaryWriter* writer) const;
+    static std::unique_ptr<BVH4> Load(const PrimitiveSet& primitives, BinaryReader* reader);
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "accelerator.h"
+#include "kdtree.h"
+
+#include <vector>
+#include <memory>
+#include <string.h>
+#include <stdint.h>
+#include <type_traits>
+
+class Mesh;
+class Material;
+
+constexpr uint32_t CACHE_VERSION = 2; // increment whenever the layout of the cached data changes
+constexpr uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+constexpr uint64_t FNV_PRIME = 1099511628211ull;
+
+// 64-bit FNV-1a hash, pass the previous hash to hash data in several pieces
+uint64_t HashFNV1a(const void* data, size_t size, uint64_t hash=FNV_OFFSET_BASIS);
+
+// growing buffer that plain values and arrays are appended to in their in-memory representation
+struct BinaryWriter {
+    std::vector<char> data;
+
+    template<typename T> void Write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be written");
+        const char* p = (const char*)&value;
+        this->data.insert(this->data.end(), p, p + sizeof(T));
+    }
+    template<typename T> void WriteArray(const std::vector<T>& values)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be written");
+        this->Write(uint64_t(values.size()));
+        const char* p = (const char*)values.data();
+        this->data.insert(this->data.end(), p, p + values.size()*sizeof(T));
+    }
+};
+
+// reads the values written by a BinaryWriter back from memory, the reads fail once the data is exhausted
+struct BinaryReader {
+    const char* data;
+    size_t size, pos;
+
+    BinaryReader(const void* data, size_t size) : data((const char*)data), size(size), pos(0) {}
+
+    template<typename T> bool Read(T* value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be read");
+        if(this->size - this->pos < sizeof(T)) return false;
+        memcpy(value, this->data + this->pos, sizeof(T));
+        this->pos += sizeof(T);
+        return true;
+    }
+    template<typename T> bool ReadArray(std::vector<T>* values)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain data can be read");
+        uint64_t n;
+        if(!this->Read(&n) || n > (this->size - this->pos) / sizeof(T)) return false;
+        values->resize(n);
+        if(n > 0) memcpy(values->data(), this->data + this->pos, n*sizeof(T));
+        this->pos += n*sizeof(T);
+        return true;
+    }
+};
+
+// imports an stl file through a cache of built meshes in cache_dir. the cache files are keyed by a hash of the file
+// contents and the build settings. on a hit the indexed mesh and its acceleration structure are read from a
+// memory-mapped cache file, otherwise the mesh is imported, built and stored in the cache. returns nullptr if the file cannot be read
+std::shared_ptr<Mesh> ReadSTLCached(const char* path, Material* material, const char* cache_dir,
+                                    AcceleratorType type=AcceleratorType::KDTREE, const KDBuildParams& params=KDBuildParams());
+
+#endif
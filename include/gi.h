@@ -6,6 +6,8 @@
 #include "sphere.h"
 #include "camera.h"
 #include "mesh.h"
+#include "instance.h"
+#include "cache.h"
 #include "microfacet_distribution.h"
 #include "hit.h"
 #include "onb.h"
@@ -16,14 +18,21 @@
 #include "import.h"
 #include "export.h"
 #include "ray.h"
-#include "triangle.h"
+#include "triangle_block.h"
 #include "kdtree.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "accelerator.h"
 #include "renderer.h"
 #include "sampler.h"
+#include "wavefront.h"
 #include "vec3.h"
 #include "mat4.h"
 #include "scene.h"
 #include "utils.h"
 #include "cube.h"
+#include "thread_pool.h"
+#include "stats.h"
+#include "tile_queue.h"
 
 #endif
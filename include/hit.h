@@ -5,14 +5,19 @@
 #include "material.h"
 
 class Surface;
+class Instance;
 struct Ray;
 struct HitRecord;
 
 struct Hit {
     double t = M_INF;
-    const Surface* s = nullptr;
+    const Surface* s = nullptr; // the hit geometry
+    const Instance* instance = nullptr; // set if s was hit in the object space of an instance
+    int prim = -1; // primitive of s for surfaces made of several primitives, such as the triangles of a mesh
+    double b1, b2; // barycentric coordinates of the hit on the primitive
 
     void RecordHit(double t, const Surface* s);
+    void RecordHit(double t, const Surface* s, int prim, double b1, double b2);
     HitRecord GetRecord(const Ray& r);
 };
 
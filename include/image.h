@@ -6,8 +6,8 @@
 #include <vector>
 
 struct Pixel {
+    Rgb sum; // of all samples, divided by their number when the pixel is read
     int num_samples;
-    Rgb val;
 };
 
 class Image {
@@ -20,7 +20,13 @@ public:
     Image(int width, int height) : width(width), height(height), data(width*height) { }
 
     void AddPixel(int x, int y, const Rgb& val);
-    inline Rgb GetPixel(int x, int y) const { return data[y*width + x].val; }
+    // adds the sums of num_samples samples to each pixel of the w x h block at (x0, y0), given in row-major order
+    void AddBlock(int x0, int y0, int w, int h, const Rgb* sums, int num_samples);
+    inline Rgb GetPixel(int x, int y) const
+    {
+        const Pixel& p = data[y*width + x];
+        return p.num_samples > 0 ? p.sum / p.num_samples : Rgb(0.0);
+    }
 
     int Width()     const   { return width; }
     int Height()    const   { return height; }
@@ -28,6 +34,9 @@ public:
     bool SaveJPG(const char* filename, int quality=90) const;
     bool SavePNG(const char* filename)  const;
     bool SavePPM(const char* filename)  const;
+    // the raw sums and sample counts of the pixels, so that renders of the same image can be merged with AddSums
+    bool SaveSums(const char* filename) const;
+    bool AddSums(const char* filename);
 };
 
 #endif
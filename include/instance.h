@@ -0,0 +1,39 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "surface.h"
+#include "mat4.h"
+#include "bbox.h"
+
+#include <memory>
+
+class Mesh;
+
+// placement of a shared mesh in the scene. the mesh and its acceleration structure are only stored once,
+// rays are transformed into the object space of the mesh instead of transforming the mesh itself
+class Instance : public Surface {
+private:
+    std::shared_ptr<Mesh> mesh;
+    Mat4 transform; // object space to world space
+    Mat4 inv_transform; // world space to object space
+    Mat4 normal_transform; // inverse transpose, for normals from object space to world space
+    std::unique_ptr<BBox> bbox;
+
+public:
+    Instance(const std::shared_ptr<Mesh>& mesh, const Mat4& transform);
+
+    virtual BBox GetBBox();
+    virtual bool Intersect(const Ray& r, Hit* h) const;
+    virtual bool Occludes(const Ray& r, double tmax) const;
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const;
+    virtual void Build();
+    void SetTransform(const Mat4& transform); // the scene refits its tree on the next call to Scene::Build()
+    const Mat4& Transform() const { return this->transform; }
+    const Mesh* GetMesh() const { return this->mesh.get(); }
+
+    // the direction is not normalized, so that distances along the ray are the same in both spaces
+    Ray ToObject(const Ray& r) const;
+    Vec3 NormalToWorld(const Vec3& n) const;
+};
+
+#endif
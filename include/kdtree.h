@@ -1,40 +1,121 @@
 #ifndef KDTREE_H
 #define KDTREE_H
 
+#include "accelerator.h"
 #include "bbox.h"
 #include "utils.h"
 
 #include <vector>
+#include <stdint.h>
 
 struct Hit;
-class Surface;
+struct TraversalCounter;
 
 constexpr double BALANCING_FACTOR = 0.85;
+constexpr int KD_MAX_DEPTH = 64; // also the size of the traversal stack
+constexpr int KD_MAILBOX_SIZE = 16; // primitives remembered per ray, power of two
 
+enum class KDBuildMethod : int { MEDIAN, SAH, };
+
+// parameters for the k-d tree builder, the costs and bins are only used by the SAH builder
+struct KDBuildParams {
+    KDBuildMethod method = KDBuildMethod::SAH;
+    double traversal_cost = 1.0; // cost of visiting an interior node
+    double intersection_cost = 80.0; // cost of intersecting a single primitive
+    double empty_bonus = 0.5; // cost reduction in [0, 1] for splits that cut off empty space
+    int num_bins = 32; // candidate split planes per axis
+    int max_depth = -1; // -1 picks 8 + 1.3*log2(n)
+};
+
+// node of the k-d tree during construction, the primitives are indices into the primitive bounds
 struct KDNode {
     Axis axis;
     double pos;
-    std::vector<Surface*> surfaces;
+    std::vector<int> primitives;
     std::unique_ptr<KDNode> left, right;
 
     KDNode() {};
-    KDNode(const std::vector<Surface*>& surfaces) : axis(Axis::NONE), pos(0), surfaces(surfaces), left(nullptr), right(nullptr) { }
+    KDNode(const std::vector<int>& primitives) : axis(Axis::NONE), pos(0), primitives(primitives), left(nullptr), right(nullptr) { }
+
+    void Split(const std::vector<BBox>& boxes, const BBox& bounds, int depth, const KDBuildParams& params);
+    bool MedianSplit(const std::vector<BBox>& boxes, Axis* axis, double* pos, int* size);
+    bool SAHSplit(const std::vector<BBox>& boxes, const BBox& bounds, const KDBuildParams& params, Axis* axis, double* pos, int* size);
+    int Partition(const std::vector<BBox>& boxes, Axis axis, double p, int size, std::vector<int>* left, std::vector<int>* right);
+    int PartitionCount(const std::vector<BBox>& boxes, Axis axis, double p) { return Partition(boxes, axis, p, 0, 0, 0); }
+};
+
+// 8 byte node of the flattened k-d tree. the lowest two bits of flags store the split axis, or 3 for leaves.
+// interior nodes store the split position and the index of their right child, the left child directly follows its parent.
+// leaves store the number of primitives and an offset into the primitive index array of the tree
+struct KDFlatNode {
+    union {
+        float split;
+        uint32_t primitive_offset;
+    };
+    uint32_t flags;
+
+    void InitLeaf(uint32_t offset, uint32_t count) { primitive_offset = offset, flags = 3 | (count << 2); }
+    void InitInterior(Axis axis, float pos, uint32_t right_child) { split = pos, flags = uint32_t(axis) | (right_child << 2); }
 
-    void Split(int depth);
-    bool Intersect(const Ray& r, Hit* h);
-    bool Intersect(const Ray& r, double tmin, double tmax, Hit* h);
-    int Partition(Axis axis, double p, int size, std::vector<Surface*>* left, std::vector<Surface*>* right);
-    int PartitionCount(Axis axis, double p) { return Partition(axis, p, 0, 0, 0); }
+    inline bool IsLeaf() const              { return (flags & 3) == 3; }
+    inline Axis SplitAxis() const           { return Axis(flags & 3); }
+    inline uint32_t RightChild() const      { return flags >> 2; }
+    inline uint32_t NumPrimitives() const   { return flags >> 2; }
 };
 
-class KDTree {
+// primitives straddling a split plane are referenced by several leaves. a ray remembers the primitives it tested in a
+// small direct mapped mailbox and skips them in later leaves, a collision only costs a redundant test
+struct KDMailbox {
+    int slots[KD_MAILBOX_SIZE];
+
+    KDMailbox() { for(int& s : slots) s = -1; }
+    // true if the primitive was tested already, otherwise it is stored
+    inline bool Visited(int prim)
+    {
+        int& slot = slots[prim & (KD_MAILBOX_SIZE - 1)];
+        if(slot == prim) return true;
+        slot = prim;
+        return false;
+    }
+};
+
+// mailbox shared by the rays of a packet, each slot remembers which rays tested its primitive
+struct KDPacketMailbox {
+    int prims[KD_MAILBOX_SIZE];
+    unsigned masks[KD_MAILBOX_SIZE];
+
+    KDPacketMailbox() { for(int& p : prims) p = -1; }
+    // returns the rays in mask that did not test the primitive yet, they are stored as having tested it
+    inline unsigned Untested(int prim, unsigned mask)
+    {
+        int slot = prim & (KD_MAILBOX_SIZE - 1);
+        if(prims[slot] != prim) prims[slot] = prim, masks[slot] = 0;
+        unsigned untested = mask & ~masks[slot];
+        masks[slot] |= mask;
+        return untested;
+    }
+};
+
+class KDTree : public Accelerator {
 private:
     BBox bbox;
-    std::unique_ptr<KDNode> root;
+    std::vector<KDFlatNode> nodes;
+    std::vector<int> indices; // primitive indices of all leaves
+    PrimitiveSet primitives;
+
+    KDTree() = default; // empty tree, filled by Load
+    void Flatten(const KDNode* node);
+    bool IntersectLeaf(const KDFlatNode& node, const Ray& r, Hit* h, KDMailbox* mailbox, TraversalCounter* counter) const;
+    template<typename LeafFunc> void Traverse(const Ray& r, double tlimit, TraversalCounter* counter, LeafFunc intersect_leaf) const;
 
 public:
-    KDTree(const std::vector<Surface*>& surfaces);
-    bool Intersect(const Ray& r, Hit* h);
+    KDTree(const PrimitiveSet& primitives, const KDBuildParams& params=KDBuildParams());
+    virtual bool Intersect(const Ray& r, Hit* h) const;
+    virtual bool IntersectAny(const Ray& r, double tmax=M_INF) const;
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const;
+    virtual BBox GetBBox() const { return this->bbox; }
+    virtual void Save(BinaryWriter* writer) const;
+    static std::unique_ptr<KDTree> Load(const PrimitiveSet& primitives, BinaryReader* reader);
 };
 
 #endif
@@ -14,6 +14,7 @@ private:
 public:
     LoadingBar(int max_val);
     void Update();
+    void Reset(); // starts over, e.g. for the next iteration
     void Done(const char* end_msg=nullptr);
 };
 
@@ -27,6 +27,7 @@ struct Mat4 {
 
     Vec3 MultiplyPosition(const Vec3& p) const;
     Vec3 MultiplyDirection(const Vec3& d) const;
+    Vec3 MultiplyVector(const Vec3& v) const; // like MultiplyDirection, but keeps the length
 };
 
 Mat4 IdentityMatrix();
@@ -19,6 +19,7 @@ public:
     virtual double Pdf(const Vec3& wo, const Vec3& wi) const { return 0; }
     virtual Vec3 Emitted(const HitRecord& hr) const { return Vec3(0); }
     virtual bool Emittable() const { return false; }
+    virtual bool NeedsUV() const { return false; } // texture coordinates are only computed for materials that sample them
     virtual ~Material() {}
 };
 
@@ -32,6 +33,7 @@ public:
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
     virtual double Pdf(const Vec3& wo, const Vec3& wi) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class Specular : public Material {
@@ -44,6 +46,7 @@ public:
 
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class DiffuseLight : public Material {
@@ -57,6 +60,7 @@ public:
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
     virtual Vec3 Emitted(const HitRecord& hr) const;
     virtual bool Emittable() const { return true; }
+    virtual bool NeedsUV() const { return this->emit->NeedsUV(); }
 };
 
 class Isotropic : public Material {
@@ -68,6 +72,7 @@ public:
 
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class OrenNayar : public Material {
@@ -82,6 +87,7 @@ public:
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
     virtual double Pdf(const Vec3& wo, const Vec3& wi) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class Dielectric : public Material {
@@ -95,6 +101,7 @@ public:
 
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class Velvet : public Material {
@@ -108,6 +115,7 @@ public:
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
     virtual double Pdf(const Vec3& wo, const Vec3& wi) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class Microfacet : public Material {
@@ -120,10 +128,13 @@ public:
         : albedo(albedo), dist(distribution), eta(eta) {}
     Microfacet(Vec3 col, MicrofacetDistribution* distribution, double eta)
         : Microfacet(new SolidTexture(col), distribution, eta) {}
+    Microfacet(Vec3 col, std::shared_ptr<MicrofacetDistribution> distribution, double eta)
+        : albedo(std::make_shared<SolidTexture>(col)), dist(distribution), eta(eta) {}
 
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual double Pdf(const Vec3& wo, const Vec3& wi) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
+    virtual bool NeedsUV() const { return this->albedo->NeedsUV(); }
 };
 
 class FresnelBlend : public Material {
@@ -135,10 +146,13 @@ public:
         : FresnelBlend(new SolidTexture(col_d), new SolidTexture(col_s), distribution) {}
     FresnelBlend(Texture* rd, Texture* rs, MicrofacetDistribution* distribution)
         : rd(rd), rs(rs), dist(distribution) {}
+    FresnelBlend(Vec3 col_d, Vec3 col_s, std::shared_ptr<MicrofacetDistribution> distribution)
+        : rd(std::make_shared<SolidTexture>(col_d)), rs(std::make_shared<SolidTexture>(col_s)), dist(distribution) {}
 
     virtual Vec3 Eval(const Vec3& wo, const Vec3& wi, const HitRecord& hr) const;
     virtual double Pdf(const Vec3& wo, const Vec3& wi) const;
     virtual Vec3 Sample(const Vec3& wo, bool* is_specular) const;
+    virtual bool NeedsUV() const { return this->rd->NeedsUV() || this->rs->NeedsUV(); }
 };
 
 
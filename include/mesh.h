@@ -1,8 +1,10 @@
 #ifndef MESH_H
 #define MESH_H
 
-#include "triangle.h"
+#include "surface.h"
+#include "triangle_block.h"
 #include "bbox.h"
+#include "accelerator.h"
 #include "kdtree.h"
 
 #ifdef EMBREE
@@ -12,35 +14,67 @@ extern RTCDevice device;
 
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
 
 class Material;
 struct Vec3;
 struct Mat4;
+struct BinaryWriter;
+struct BinaryReader;
 
 // triangle mesh
 class Mesh : public Surface {
 private:
-    friend class Triangle;
+    friend class TriangleBlocks;
     std::unique_ptr<BBox> bbox;
-    std::unique_ptr<KDTree> tree;
+    std::unique_ptr<Accelerator> tree;
+    AcceleratorType accel_type;
+    bool accel_chosen; // set with SetAccelerator, otherwise a k-d tree that has to be refit is replaced by a bvh
+    KDBuildParams kd_params;
+    bool needs_refit; // positions changed since the tree was built
 
     int num_triangles;
-    std::vector<int> indices; // face indices
-    std::vector<Vec3> positions, normals, texcoords;
-    std::vector<Triangle> triangles; // triangle interfaces for shape intersection
+    std::vector<int> indices; // face indices, triangles are identified by their position in this array
+    std::vector<GeometryVec3> positions, normals, texcoords;
+    Material* material;
+    TriangleBlocks blocks; // groups of triangles the accelerator is built over
+    std::mutex bbox_mutex;
+    std::atomic<std::thread::id> builder{std::thread::id()}; // thread building the tree, a mesh can be built by several instances at once
 #ifdef EMBREE
-    RTCScene embree_scene;
+    RTCScene embree_scene = nullptr;
 #endif
 
     void Dirtify();
+    void BuildBBox();
+    BBox TriangleBBox(int prim) const;
+    Vec3 TriangleNormal(int prim) const; // geometric normal
+    bool IntersectTriangle(int prim, const Ray& r, Hit* h) const;
+    std::vector<int> GroupTriangles(); // face indices of each block, padded with -1
 public:
     Mesh(const std::vector<Vec3>& positions, Material* material);
     Mesh(const std::vector<Vec3>& positions, const std::vector<Vec3>& normals, Material* material);
     Mesh(const std::vector<Vec3>& positions, const std::vector<Vec3>& normals, const std::vector<Vec3>& texcoords, Material* material);
+    // already indexed vertex data, no duplicate vertices are removed
+    Mesh(const std::vector<int>& indices, const std::vector<Vec3>& positions, const std::vector<Vec3>& normals, const std::vector<Vec3>& texcoords, Material* material);
+#ifdef EMBREE
+    ~Mesh();
+    RTCScene EmbreeScene() const { return this->embree_scene; } // instanced by the embree scene of the Scene
+#endif
 
     virtual BBox GetBBox();
     virtual bool Intersect(const Ray& r, Hit* h) const;
+    virtual bool Occludes(const Ray& r, double tmax) const;
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const;
+    virtual void FillRecord(const Hit& h, const Vec3& p, HitRecord* hr) const;
     virtual void Build();
+    void SetAccelerator(AcceleratorType type);
+    void SetKDBuildParams(const KDBuildParams& params);
+
+    // serialization of the built mesh, see ReadSTLCached
+    void Save(BinaryWriter* writer);
+    static std::shared_ptr<Mesh> Load(BinaryReader* reader, Material* material);
 
     // mesh transformations
     void Transform(const Mat4& m);
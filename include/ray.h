@@ -11,4 +11,47 @@ struct Ray {
     inline Vec3 PositionAt(double t) const { return origin + t*direction; }
 };
 
+constexpr int RAY_PACKET_SIZE = 8;
+
+// coherent rays that are traced together, such as the primary rays of neighbouring pixels.
+// the packet traversal functions take a bit mask of the rays that are still active
+struct RayPacket {
+    Ray rays[RAY_PACKET_SIZE];
+    int size = 0;
+
+    inline unsigned FullMask() const { return (1u << size) - 1; }
+
+    // true if the directions of the active rays have the same nonzero signs, so that they visit nodes in the same order
+    inline bool Coherent(unsigned mask) const
+    {
+        if(mask == 0) return false;
+        const Vec3& d0 = rays[__builtin_ctz(mask)].direction;
+        if(d0.x == 0 || d0.y == 0 || d0.z == 0) return false;
+        for(int i = 0; i < RAY_PACKET_SIZE; ++i) {
+            if(!((mask >> i) & 1)) continue;
+            const Vec3& d = rays[i].direction;
+            if(d.x*d0.x <= 0 || d.y*d0.y <= 0 || d.z*d0.z <= 0) return false;
+        }
+        return true;
+    }
+};
+
+// packet rays in structure of arrays layout for the traversal loops, inactive lanes repeat an active ray
+struct alignas(16) RayPacketSoA {
+    double origin[3][RAY_PACKET_SIZE];
+    double inv_dir[3][RAY_PACKET_SIZE];
+
+    RayPacketSoA(const RayPacket& p, unsigned mask)
+    {
+        int first = __builtin_ctz(mask);
+        for(int i = 0; i < RAY_PACKET_SIZE; ++i) {
+            const Ray& r = p.rays[(mask >> i) & 1 ? i : first];
+            for(int axis = 0; axis < 3; ++axis) {
+                this->origin[axis][i] = r.origin[axis];
+                this->inv_dir[axis][i] = 1.0 / r.direction[axis];
+            }
+        }
+    }
+};
+
 #endif
@@ -2,13 +2,32 @@
 #define RENDERER_H
 
 #include "image.h"
+#include "stats.h"
 
 #include <string>
-#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <stdint.h>
 
 class Scene;
 class Camera;
 class LoadingBar;
+class TileQueue;
+class ThreadPool;
+struct Tile;
+struct RenderThreadState;
+
+// PATH traces every path to completion, WAVEFRONT advances all paths of a row bounce by bounce in batched stages
+enum class IntegratorType : int { PATH, WAVEFRONT, };
+
+// work spent on a pixel, summed over all of its samples
+struct PixelCost {
+    uint64_t nodes_visited = 0;
+    uint64_t primitives_tested = 0;
+    uint64_t nanoseconds = 0;
+    int num_samples = 0;
+};
 
 class Renderer {
 private:
@@ -17,14 +36,39 @@ private:
     Image img;
     int spp;
     int num_threads;
-    std::atomic<int> global_ray_count;
+    bool pin_threads;
+    std::unique_ptr<ThreadPool> pool; // lives across iterations, created by the first call to Render
+    std::vector<std::unique_ptr<RenderThreadState>> thread_states; // one per thread of the pool, see ThreadPool::WorkerIndex
+    IntegratorType integrator;
+    RayStats frame_stats; // summed over all threads of the current iteration
+    std::mutex stats_mutex;
+    std::string stats_filename;
+    bool heatmap;
+    std::vector<PixelCost> costs;
 
-    void SaveImage(std::string filename, int iter);
-    void RenderFrame(int thread_id, LoadingBar* lb);
+    void SaveImage(const Image& img, std::string filename, int iter);
+    void SaveHeatmaps(const std::string& filename, int iter);
+    void RenderFrame(int thread_id, TileQueue* queue, LoadingBar* lb);
+    void RenderTile(const Tile& tile, RenderThreadState* state);
+    void RenderTileWavefront(const Tile& tile, RenderThreadState* state);
+    void RenderTileCosts(const Tile& tile, RenderThreadState* state);
+    void AddThreadStats();
 
 public:
     Renderer(Scene* scene, Camera* cam, int w, int h, int spp=16);
+    ~Renderer();
     void Render(std::string filename, int num_iterations=M_INF);
+    // threads that render, including the one calling Render, by default one per core
+    void SetNumThreads(int num_threads);
+    // binds every render thread except the one calling Render to a core of its own
+    void SetThreadAffinity(bool pin_threads);
+    void SetIntegrator(IntegratorType type) { this->integrator = type; }
+    // writes the statistics of every iteration to the file, one json object per line
+    void SetStatsFile(const std::string& filename) { this->stats_filename = filename; }
+    // also saves false colour images of the traversal steps, primitive tests and nanoseconds per sample of every pixel
+    // next to the image, e.g. "out_nodes.png", "out_prims.png" and "out_time.png" for "out.png". the pixels are traced
+    // one at a time with the path integrator to measure their cost, so this renders slower than usual
+    void SetHeatmap(bool enable) { this->heatmap = enable; }
 };
 
 #endif
@@ -1,11 +1,43 @@
 #ifndef SAMPLER_H
 #define SAMPLER_H
 
+#include "vec3.h"
+#include "ray.h"
+
 class Scene;
-struct Ray;
-struct Vec3;
+class ONB;
+struct Hit;
+struct HitRecord;
+
+// state of a path between two bounces
+struct PathState {
+    Ray ray; // next ray to trace
+    Vec3 col, throughput;
+    bool is_specular;
+    int num_bounces;
+
+    PathState(const Ray& ray) : ray(ray), col(0.0), throughput(1.0), is_specular(true), num_bounces(0) {}
+};
+
+// direct lighting that reaches the path if nothing blocks the ray before tmax
+struct ShadowRay {
+    Ray ray;
+    double tmax;
+    Vec3 contribution;
+
+    bool Contributes() const { return contribution.MaxComponent() > 0; }
+};
 
 Vec3 Sample(Scene* scene, const Ray& ray, int min_bounces=4, int max_bounces=50);
+// continues the path from the first intersection of the ray, e.g. one found by a packet of primary rays
+Vec3 Sample(Scene* scene, const Ray& ray, const Hit& first_hit, int min_bounces=4, int max_bounces=50);
 Vec3 SampleAO(Scene* scene, const Ray& ray, int num_samples=1);
+Vec3 SampleBackground(Scene* scene, const Ray& ray);
+
+// samples the direct lighting of one randomly picked light, returns false if the sample does not contribute
+bool SampleOneLight(Scene* scene, const ONB& onb, const HitRecord& hr, const Vec3& wo, ShadowRay* shadow_ray);
+// one bounce of the path at hr, or at the background if hr is nullptr. the direct lighting is returned as a shadow ray
+// for the caller to trace. returns false once the path has terminated, otherwise path->ray is the next ray to trace
+bool ShadeHit(Scene* scene, PathState* path, const HitRecord* hr, ShadowRay* shadow_ray, int min_bounces=4);
 
 #endif
@@ -1,40 +1,76 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include "accelerator.h"
 #include "kdtree.h"
+#include "stats.h"
 
 #include <vector>
 #include <memory>
 
+#ifdef EMBREE
+#include <embree3/rtcore.h>
+#endif
+
 class Surface;
+class Mesh;
+class Instance;
 class Texture;
 struct Hit;
 struct Ray;
+struct RayPacket;
 
 class Scene {
 private:
     std::vector<Surface*> surfaces;
     std::vector<Surface*> lights;
-    std::unique_ptr<KDTree> tree;
+    std::vector<Surface*> bounded; // surfaces the tree is built over
+    std::vector<Surface*> unbounded; // surfaces such as planes that would end up in every leaf, tested for each ray instead
+    std::unique_ptr<Accelerator> tree;
+    AcceleratorType accel_type;
+    bool accel_chosen; // set with SetAccelerator, otherwise a k-d tree that has to be refit is replaced by a bvh
+    KDBuildParams kd_params;
+    std::vector<BBox> surface_bounds; // bounds of the bounded surfaces when the tree was last built or refit
+
+    bool SurfacesChanged();
+
+#ifdef EMBREE
+    // with embree the bounded surfaces are traced by a single embree scene instead of the tree: meshes and their
+    // instances as instances of the embree scenes of the meshes, all other surfaces as user geometry
+    struct EmbreeGeometry {
+        const Mesh* mesh; // nullptr for user geometry
+        const Instance* instance;
+    };
+    RTCScene embree_scene = nullptr;
+    std::vector<EmbreeGeometry> embree_geometries; // indexed by geometry id
+
+    void BuildEmbreeScene();
+    bool RecordEmbreeHit(RTCRayHitN* rayhit, unsigned N, unsigned i, const Hit* user_hits, Hit* h) const;
+#endif
 
     std::shared_ptr<Texture> background_texture;
     Vec3 background_color;
 
 public:
-    Scene() : background_texture(nullptr), background_color(Vec3(0.0)) {};
+    Scene() : accel_type(AcceleratorType::KDTREE), accel_chosen(false), background_texture(nullptr), background_color(Vec3(0.0)) {};
+#ifdef EMBREE
+    ~Scene();
+#endif
     void Add(Surface* s);
     void Add(std::shared_ptr<Surface> s);
-    bool Intersect(const Ray& r, Hit* h);
+    // the ray type is only used for the statistics of the thread, see ThreadRayStats
+    bool Intersect(const Ray& r, Hit* h, RayType type=RayType::EXTENSION);
+    bool Occluded(const Ray& r, double tmax=M_INF, RayType type=RayType::SHADOW); // true if anything blocks the ray before tmax
+    void IntersectPacket(const RayPacket& p, Hit* hits, RayType type=RayType::EXTENSION); // closest hits of all rays of the packet
     void Build();
     std::vector<Surface*> Lights() const { return this->lights; }
+    void SetAccelerator(AcceleratorType type);
+    void SetKDBuildParams(const KDBuildParams& params);
 
     void SetBackgroundColor(const Vec3& col) { this->background_color = col; }
     void SetBackgroundTexture(const std::shared_ptr<Texture>& t) { this->background_texture = t; }
     Vec3 BackgroundColor() const { return this->background_color; }
     Texture* BackgroundTexture() const { return this->background_texture.get(); }
-
-    static unsigned RayCount();
-    static void ResetRayCount();
 };
 
 #endif
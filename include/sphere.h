@@ -13,7 +13,8 @@ private:
     BBox bbox;
 
 public:
-    Sphere(Vec3 centre, double radius, Material* material);
+    Sphere(Vec3 centre, double radius, Material* material); // takes ownership of the material
+    Sphere(Vec3 centre, double radius, std::shared_ptr<Material> material);
 
     virtual BBox GetBBox();
     virtual bool Intersect(const Ray& r, Hit* h) const;
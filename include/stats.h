@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum class RayType : int { CAMERA, EXTENSION, SHADOW, AO, };
+constexpr int NUM_RAY_TYPES = 4;
+
+// counters of the work done while rendering. every thread counts into its own instance, see ThreadRayStats,
+// which the renderer sums up after each iteration
+struct RayStats {
+    uint64_t rays[NUM_RAY_TYPES] = {};
+    uint64_t nodes_visited = 0;
+    uint64_t primitives_tested = 0;
+    uint64_t mailbox_hits = 0; // primitive tests skipped because the ray already tested the primitive
+    uint64_t shading_calls = 0;
+
+    uint64_t TotalRays() const;
+    RayStats& operator+=(const RayStats& s);
+    void Print() const;
+    void WriteJSON(FILE* f) const; // a single json object
+};
+
+RayStats& ThreadRayStats(); // counters of the calling thread
+
+// counts a single traversal in registers and adds the result to the thread counters once it is done
+struct TraversalCounter {
+    uint32_t nodes_visited = 0;
+    uint32_t primitives_tested = 0;
+    uint32_t mailbox_hits = 0;
+
+    ~TraversalCounter();
+};
+
+#endif
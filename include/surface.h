@@ -9,16 +9,21 @@
 struct BBox;
 struct Ray;
 struct Hit;
+struct HitRecord;
 class Material;
 
 class Surface {
 public:
     virtual BBox GetBBox() = 0;
     virtual bool Intersect(const Ray& r, Hit* h) const = 0;
+    virtual bool Occludes(const Ray& r, double tmax) const; // any-hit query in (M_EPS, tmax), for visibility only
+    virtual void IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const; // Intersect for every active ray
     virtual Vec3 UV(const Vec3& p) const { return {}; }
     virtual Vec3 NormalAt(const Vec3& p) const { return {}; }
     virtual Material* MaterialAt(const Vec3& p) const { return nullptr; }
     virtual bool Emittable() const { return false; }
+    // normal, material and uv of a hit at p, surfaces made of primitives use the primitive and barycentrics of the hit
+    virtual void FillRecord(const Hit& h, const Vec3& p, HitRecord* hr) const;
     virtual Ray RandomRay(const Vec3& hit_point) const { return {}; }
     virtual double Pdf(const Ray& r) const { return 0; }
     virtual void Build() {}
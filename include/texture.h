@@ -10,6 +10,7 @@
 class Texture {
 public:
     virtual Vec3 Sample(double u, double v, const Vec3& p) const = 0;
+    virtual bool NeedsUV() const { return true; } // false if Sample ignores u and v
     virtual ~Texture() {};
 };
 
@@ -20,6 +21,7 @@ public:
     SolidTexture() : color(0) {}
     SolidTexture(const Vec3& color) : color(color) {}
     virtual Vec3 Sample(double u, double v, const Vec3& p) const { return color; }
+    virtual bool NeedsUV() const { return false; }
 };
 
 class CheckeredTexture : public Texture {
@@ -30,6 +32,7 @@ public:
     CheckeredTexture(double size=0.5) : CheckeredTexture(new SolidTexture(0), new SolidTexture(1), size) {}
     CheckeredTexture(Texture* a, Texture* b, double size=0.5) : a(a), b(b), freq(2*M_PI / size) {}
     virtual Vec3 Sample(double u, double v, const Vec3& p) const;
+    virtual bool NeedsUV() const { return a->NeedsUV() || b->NeedsUV(); }
 };
 
 class GridTexture : public Texture {
@@ -39,6 +42,7 @@ private:
 public:
     GridTexture(Texture* a, Texture* b, double spacing, double width) : a(a), b(b), spacing(spacing), width(width) {}
     virtual Vec3 Sample(double u, double v, const Vec3& p) const;
+    virtual bool NeedsUV() const { return a->NeedsUV() || b->NeedsUV(); }
 };
 
 class ImageTexture : public Texture {
@@ -0,0 +1,66 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::function<void()> Task;
+
+// work-stealing thread pool: every worker pushes and pops tasks at the back of its own deque,
+// and steals from the front of the other deques when it runs out of work
+class ThreadPool {
+private:
+    struct TaskQueue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+    std::vector<std::unique_ptr<TaskQueue>> queues; // one per worker + one for tasks submitted from outside the pool
+    std::vector<std::thread> threads;
+    std::atomic<int> num_queued;
+    std::mutex sleep_mtx;
+    std::condition_variable wake;
+    bool stop;
+
+    void WorkerLoop(int worker_id);
+    bool PopTask(int queue_id, Task* task);
+    void PinThreads();
+
+public:
+    // pinned workers are bound to a core each, starting at the second core the process may run on as the first one is
+    // left to the thread that submits the tasks and helps out while waiting. cores that cannot be pinned are reported
+    ThreadPool(int num_threads, bool pin_threads=false);
+    ~ThreadPool();
+
+    void Submit(Task task);
+    bool RunPendingTask(); // runs one queued task on the calling thread, returns false if there was none
+    int NumThreads() const { return this->threads.size(); }
+    int WorkerIndex() const; // worker the calling thread is, NumThreads() for threads outside of the pool
+
+    // shared pool with one worker less than the number of cores, since waiting threads help out
+    static ThreadPool* Global();
+};
+
+// set of tasks that can be waited on, the waiting thread executes queued tasks in the meantime
+class TaskGroup {
+private:
+    ThreadPool* pool;
+    std::atomic<int> num_pending;
+
+public:
+    TaskGroup(ThreadPool* pool=ThreadPool::Global()) : pool(pool), num_pending(0) {}
+    ~TaskGroup() { this->Wait(); }
+
+    void Run(Task task);
+    void Wait();
+};
+
+// calls func(chunk_begin, chunk_end) for chunks of at most grain_size elements in [begin, end)
+void ParallelFor(int begin, int end, int grain_size, const std::function<void(int, int)>& func);
+
+#endif
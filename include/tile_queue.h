@@ -0,0 +1,44 @@
+#ifndef TILE_QUEUE_H
+#define TILE_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+constexpr int TILE_SIZE = 16; // pixels along each side of a tile
+
+// pixels [x0, x1) x [y0, y1) of the image
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// tiles covering the image, ordered along a morton curve so that consecutive tiles are next to each other
+std::vector<Tile> MortonOrderedTiles(int width, int height, int tile_size=TILE_SIZE);
+
+// lock-free work-stealing queue of tiles: every thread starts out with a contiguous range of the tiles and takes them
+// from the front of its range. a thread that runs out of tiles steals from the back of the range with the most left
+class TileQueue {
+private:
+    // begin in the upper and end in the lower 32 bits, so both are updated with a single compare and swap.
+    // padded to a cache line, so that the threads do not invalidate each others ranges
+    struct Range {
+        std::atomic<uint64_t> bits;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    std::vector<Tile> tiles;
+    std::unique_ptr<Range[]> ranges;
+    int num_threads;
+
+    bool PopFront(int thread_id, int* index);
+    bool PopBack(int thread_id, int* index);
+
+public:
+    TileQueue(const std::vector<Tile>& tiles, int num_threads);
+
+    bool Next(int thread_id, Tile* tile); // returns false once all tiles have been taken
+    void Reset(); // hands out all tiles again
+    int NumTiles() const { return this->tiles.size(); }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TRIANGLE_BLOCK_H
+#define TRIANGLE_BLOCK_H
+
+#include "bbox.h"
+
+#include <vector>
+
+constexpr int TRIANGLE_BLOCK_SIZE = 4; // triangles tested at once, one per sse lane
+constexpr float TRIANGLE_BLOCK_EPS = 1e-4f; // widens the single precision test to make up for its rounding errors
+
+class Mesh;
+struct Ray;
+struct RayPacket;
+struct Hit;
+
+// 176 byte block of spatially close triangles. the vertex0/edge1/edge2 data is stored in single precision as structure
+// of arrays, so a ray can be tested against all triangles of the block at once. unused lanes have face -1 and zero
+// vertex data, which the test rejects as degenerate
+struct alignas(16) TriangleBlock {
+    float v0[3][TRIANGLE_BLOCK_SIZE], e1[3][TRIANGLE_BLOCK_SIZE], e2[3][TRIANGLE_BLOCK_SIZE];
+    float anchor[3]; // vertex data is stored relative to this point to keep the single precision values small
+    float extent; // largest side of the bounds
+    int faces[TRIANGLE_BLOCK_SIZE]; // face indices into the mesh
+};
+
+// the triangles of a mesh grouped into blocks, the mesh accelerators are built over these blocks and index them
+// directly. the single precision test only culls, every triangle it keeps is decided by the double precision triangle
+// test of the mesh, so hits do not depend on how the triangles are grouped
+class TriangleBlocks {
+private:
+    const Mesh* mesh;
+    std::vector<TriangleBlock> blocks;
+
+    unsigned Candidates(const TriangleBlock& b, const Ray& r, double tmax) const;
+public:
+    TriangleBlocks(const Mesh* mesh) : mesh(mesh) {}
+
+    void Assign(const std::vector<int>& block_faces); // face indices of each block, padded with -1
+    void Update(); // recomputes the vertex data after the mesh positions changed
+    int Size() const { return int(this->blocks.size()); }
+    const int* Faces(int i) const { return this->blocks[i].faces; }
+
+    BBox Bounds(int i) const;
+    bool Intersect(int i, const Ray& r, Hit* h) const;
+    bool Occludes(int i, const Ray& r, double tmax) const;
+    void IntersectPacket(int i, const RayPacket& p, Hit* hits, unsigned mask) const;
+};
+
+#endif
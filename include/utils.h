@@ -23,6 +23,11 @@ template<typename T> static inline T Clamp(T v, T mn, T mx)     { return (v < mn
 template<typename T> static inline T Lerp(T a, T b, double t)   { return (T)(a + (b - a)*t); }
 template<typename T> static inline void Swap(T& a, T& b)        { T tmp = a; a = b; b = tmp; }
 
+// rounds to the nearest float that is not larger/smaller than the value, keeps single precision bounds conservative
+float RoundDown(double x);
+float RoundUp(double x);
+
+void SeedRandom(unsigned seed); // seeds the random numbers of the calling thread, e.g. for reproducible benchmarks
 double RandomUniform(double a=0., double b=1.);
 int RandomUniform(int a, int b);
 
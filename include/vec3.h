@@ -29,6 +29,21 @@ struct Vec3 {
     inline double operator[](int i) const   { return data[i]; }
 };
 
+// single precision vector to store geometry compactly, all arithmetic is done on Vec3
+struct Vec3f {
+    float x, y, z;
+    Vec3f() = default;
+    Vec3f(const Vec3& v) : x(v.x), y(v.y), z(v.z) { }
+    operator Vec3() const { return { x, y, z }; }
+};
+
+// storage type of mesh vertex data, single precision when built with SINGLE_PRECISION=1
+#ifdef SINGLE_PRECISION
+typedef Vec3f GeometryVec3;
+#else
+typedef Vec3 GeometryVec3;
+#endif
+
 static inline Vec3 RandomUnitVector() { return Vec3(RandomUniform(-1,1), RandomUniform(-1,1), RandomUniform(-1,1)).Normalized(); }
 
 static inline Vec3 operator*(const Vec3& lhs, const double rhs)     { return { lhs.x*rhs, lhs.y*rhs, lhs.z*rhs }; }
@@ -0,0 +1,37 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "sampler.h"
+#include "hit.h"
+#include "stats.h"
+
+#include <vector>
+#include <stdint.h>
+
+class Scene;
+
+// path tracer that advances a large batch of paths one bounce at a time instead of tracing every path to completion.
+// each bounce runs as separate stages over the whole batch: closest hits of the extension rays, hit records,
+// shading sorted by material, and finally the shadow rays, so that every stage keeps its code and data in cache
+class WavefrontIntegrator {
+private:
+    Scene* scene;
+    int min_bounces, max_bounces;
+    std::vector<PathState> paths;
+    std::vector<Hit> hits;
+    std::vector<HitRecord> records;
+    std::vector<ShadowRay> shadow_rays;
+    std::vector<uint8_t> alive;
+    std::vector<int> active; // indices of the paths that have not terminated
+
+    void Extend(RayType type);
+    void Shade();
+    void TraceShadowRays();
+
+public:
+    WavefrontIntegrator(Scene* scene, int min_bounces=4, int max_bounces=50);
+    // radiance along each of the rays, neighbouring rays should be coherent as they are traced as packets first
+    void Trace(const std::vector<Ray>& rays, std::vector<Vec3>* cols);
+};
+
+#endif
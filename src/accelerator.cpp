@@ -0,0 +1,36 @@
+#include "accelerator.h"
+
+#include "kdtree.h"
+#include "bvh.h"
+#include "bvh4.h"
+#include "ray.h"
+#include "hit.h"
+
+void Accelerator::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
+    for(int i = 0; i < p.size; ++i) {
+        if((mask >> i) & 1) this->Intersect(p.rays[i], &hits[i]);
+    }
+}
+
+std::unique_ptr<Accelerator> BuildAccelerator(AcceleratorType type, const PrimitiveSet& primitives, const KDBuildParams& kd_params)
+{
+    switch(type) {
+        case AcceleratorType::BVH:
+            return std::make_unique<BVH>(primitives);
+        case AcceleratorType::BVH4:
+            return std::make_unique<BVH4>(primitives);
+        case AcceleratorType::KDTREE: default:
+            return std::make_unique<KDTree>(primitives, kd_params);
+    }
+}
+
+std::unique_ptr<Accelerator> LoadAccelerator(AcceleratorType type, const PrimitiveSet& primitives, BinaryReader* reader)
+{
+    switch(type) {
+        case AcceleratorType::KDTREE: return KDTree::Load(primitives, reader);
+        case AcceleratorType::BVH: return BVH::Load(primitives, reader);
+        case AcceleratorType::BVH4: return BVH4::Load(primitives, reader);
+        default: return nullptr;
+    }
+}
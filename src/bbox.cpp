@@ -1,7 +1,6 @@
 #include "bbox.h"
 
 #include "ray.h"
-#include "surface.h"
 #include "utils.h"
 
 BBox BBox::Union(const BBox& b) const
@@ -22,6 +21,11 @@ bool BBox::Intersects(const BBox& b)  const
              this->max_point.y < b.min_point.y || this->min_point.z > b.max_point.z || this->max_point.z < b.min_point.z);
 }
 
+bool BBox::Unbounded() const
+{
+    return this->min_point.MinComponent() <= -M_INF || this->max_point.MaxComponent() >= M_INF;
+}
+
 bool BBox::Intersect(const Ray& r, double* tmin, double* tmax) const
 {
     double x1 = (this->min_point.x - r.origin.x) / r.direction.x;
@@ -68,12 +72,19 @@ Vec3 BBox::Anchor(const Vec3& anchor) const
     return this->min_point + this->Size()*anchor;
 }
 
-BBox SurroundingBBox(const std::vector<Surface*>& surfaces)
+BBoxf::BBoxf(const BBox& b)
+{
+    this->min_point.x = RoundDown(b.min_point.x), this->max_point.x = RoundUp(b.max_point.x);
+    this->min_point.y = RoundDown(b.min_point.y), this->max_point.y = RoundUp(b.max_point.y);
+    this->min_point.z = RoundDown(b.min_point.z), this->max_point.z = RoundUp(b.max_point.z);
+}
+
+BBox SurroundingBBox(const std::vector<BBox>& boxes)
 {
-    if(surfaces.size() == 0) return {};
-    BBox b = surfaces[0]->GetBBox();
-    for(const auto& s : surfaces) {
-        b = b.Union(s->GetBBox());
+    if(boxes.size() == 0) return {};
+    BBox b = boxes[0];
+    for(const BBox& box : boxes) {
+        b = b.Union(box);
     }
     return b;
 }
@@ -0,0 +1,394 @@
+#include "bvh.h"
+
+#include "utils.h"
+#include "surface.h"
+#include "hit.h"
+#include "stats.h"
+#include "ray.h"
+#include "cache.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// children with at least this many primitives are built as separate tasks
+static constexpr int PARALLEL_SUBTREE_SIZE = 1024;
+
+static inline double SurfaceArea(const BBox& b)
+{
+    Vec3 size = b.Size();
+    return 2.0*(size.x*size.y + size.y*size.z + size.z*size.x);
+}
+
+// slab test against the ray segment [0, tmax], using the precomputed inverse ray direction
+template<typename Box>
+static inline bool IntersectBounds(const Box& b, const Vec3& origin, const Vec3& inv_dir, double tmax)
+{
+    double tx1 = (b.min_point.x - origin.x)*inv_dir.x, tx2 = (b.max_point.x - origin.x)*inv_dir.x;
+    double ty1 = (b.min_point.y - origin.y)*inv_dir.y, ty2 = (b.max_point.y - origin.y)*inv_dir.y;
+    double tz1 = (b.min_point.z - origin.z)*inv_dir.z, tz2 = (b.max_point.z - origin.z)*inv_dir.z;
+    double t0 = Max(Max(Min(tx1, tx2), Min(ty1, ty2)), Min(tz1, tz2));
+    double t1 = Min(Min(Max(tx1, tx2), Max(ty1, ty2)), Max(tz1, tz2));
+    return t1 >= Max(t0, 0.0) && t0 <= tmax;
+}
+
+// slab test of the rays of a packet against the segments [0, tmax[i]], returns the mask of the active rays that hit the box.
+// the rays are tested two at a time in double precision, so that they agree with the single ray test
+template<typename Box>
+static inline unsigned IntersectBounds(const Box& b, const RayPacketSoA& r, const double* tmax, unsigned mask)
+{
+#ifdef __SSE2__
+    const __m128d min_x = _mm_set1_pd(b.min_point.x), min_y = _mm_set1_pd(b.min_point.y), min_z = _mm_set1_pd(b.min_point.z);
+    const __m128d max_x = _mm_set1_pd(b.max_point.x), max_y = _mm_set1_pd(b.max_point.y), max_z = _mm_set1_pd(b.max_point.z);
+    unsigned hit_mask = 0;
+    for(int i = 0; i < RAY_PACKET_SIZE; i += 2) {
+        __m128d ox = _mm_load_pd(&r.origin[0][i]), oy = _mm_load_pd(&r.origin[1][i]), oz = _mm_load_pd(&r.origin[2][i]);
+        __m128d idx = _mm_load_pd(&r.inv_dir[0][i]), idy = _mm_load_pd(&r.inv_dir[1][i]), idz = _mm_load_pd(&r.inv_dir[2][i]);
+        __m128d tx1 = _mm_mul_pd(_mm_sub_pd(min_x, ox), idx), tx2 = _mm_mul_pd(_mm_sub_pd(max_x, ox), idx);
+        __m128d ty1 = _mm_mul_pd(_mm_sub_pd(min_y, oy), idy), ty2 = _mm_mul_pd(_mm_sub_pd(max_y, oy), idy);
+        __m128d tz1 = _mm_mul_pd(_mm_sub_pd(min_z, oz), idz), tz2 = _mm_mul_pd(_mm_sub_pd(max_z, oz), idz);
+        __m128d t0 = _mm_max_pd(_mm_max_pd(_mm_min_pd(tx1, tx2), _mm_min_pd(ty1, ty2)), _mm_min_pd(tz1, tz2));
+        __m128d t1 = _mm_min_pd(_mm_min_pd(_mm_max_pd(tx1, tx2), _mm_max_pd(ty1, ty2)), _mm_max_pd(tz1, tz2));
+        __m128d hit = _mm_and_pd(_mm_cmpge_pd(t1, _mm_max_pd(t0, _mm_setzero_pd())), _mm_cmple_pd(t0, _mm_load_pd(&tmax[i])));
+        hit_mask |= unsigned(_mm_movemask_pd(hit)) << i;
+    }
+    return hit_mask & mask;
+#else
+    unsigned hit_mask = 0;
+    for(unsigned m = mask; m != 0; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        double tx1 = (b.min_point.x - r.origin[0][i])*r.inv_dir[0][i], tx2 = (b.max_point.x - r.origin[0][i])*r.inv_dir[0][i];
+        double ty1 = (b.min_point.y - r.origin[1][i])*r.inv_dir[1][i], ty2 = (b.max_point.y - r.origin[1][i])*r.inv_dir[1][i];
+        double tz1 = (b.min_point.z - r.origin[2][i])*r.inv_dir[2][i], tz2 = (b.max_point.z - r.origin[2][i])*r.inv_dir[2][i];
+        double t0 = Max(Max(Min(tx1, tx2), Min(ty1, ty2)), Min(tz1, tz2));
+        double t1 = Min(Min(Max(tx1, tx2), Max(ty1, ty2)), Max(tz1, tz2));
+        if(t1 >= Max(t0, 0.0) && t0 <= tmax[i]) hit_mask |= 1u << i;
+    }
+    return hit_mask;
+#endif
+}
+
+struct BVHBin {
+    BBox bounds;
+    int count = 0;
+};
+
+void BVHNode::Split(const std::vector<BBox>& boxes, const std::vector<Vec3>& centroids, std::vector<int>* indices, int depth)
+{
+    int* prims = indices->data();
+    int n = this->end - this->begin;
+    this->bounds = boxes[prims[this->begin]];
+    BBox centroid_bounds(centroids[prims[this->begin]], centroids[prims[this->begin]]);
+    for(int i = this->begin + 1; i < this->end; ++i) {
+        this->bounds = this->bounds.Union(boxes[prims[i]]);
+        centroid_bounds = centroid_bounds.Union(BBox(centroids[prims[i]], centroids[prims[i]]));
+    }
+    if(n == 1) return; // leaf node
+
+    Vec3 extent = centroid_bounds.Size();
+    int largest_axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    int mid = this->begin + n/2;
+    if(extent[largest_axis] <= 0) { // all centroids coincide, so they cannot be separated by a plane
+        if(n <= BVH_MAX_LEAF_SIZE) return;
+        this->axis = Axis(largest_axis);
+    }
+    else if(depth >= BVH_MAX_DEPTH / 2) {
+        // keep the depth bounded by the traversal stack, balanced splits need at most log2(n) more levels
+        this->axis = Axis(largest_axis);
+        std::nth_element(prims + this->begin, prims + mid, prims + this->end, [&](int a, int b) {
+            return centroids[a][largest_axis] < centroids[b][largest_axis];
+        });
+    }
+    else {
+        // bin the centroids along every axis and sweep the bin boundaries as candidate split planes
+        double inv_area = 1.0 / SurfaceArea(this->bounds);
+        double best_cost = M_INF;
+        int best_axis = largest_axis, best_bin = BVH_NUM_BINS / 2;
+        for(int a = 0; a < 3; ++a) {
+            if(extent[a] <= 0) continue;
+            BVHBin bins[BVH_NUM_BINS];
+            double lo = centroid_bounds.min_point[a], scale = BVH_NUM_BINS / extent[a];
+            for(int i = this->begin; i < this->end; ++i) {
+                int b = Min(int((centroids[prims[i]][a] - lo)*scale), BVH_NUM_BINS - 1);
+                bins[b].bounds = bins[b].count == 0 ? boxes[prims[i]] : bins[b].bounds.Union(boxes[prims[i]]);
+                bins[b].count++;
+            }
+            // area and count of everything to the right of each bin boundary
+            double right_area[BVH_NUM_BINS];
+            int right_count[BVH_NUM_BINS];
+            BBox side_bounds;
+            int count = 0;
+            for(int i = BVH_NUM_BINS - 1; i > 0; --i) {
+                if(bins[i].count > 0) side_bounds = count == 0 ? bins[i].bounds : side_bounds.Union(bins[i].bounds);
+                count += bins[i].count;
+                right_area[i] = count > 0 ? SurfaceArea(side_bounds) : 0.0, right_count[i] = count;
+            }
+            count = 0;
+            for(int i = 0; i < BVH_NUM_BINS - 1; ++i) {
+                if(bins[i].count > 0) side_bounds = count == 0 ? bins[i].bounds : side_bounds.Union(bins[i].bounds);
+                count += bins[i].count;
+                if(count == 0 || right_count[i+1] == 0) continue;
+                double cost = BVH_TRAVERSAL_COST + (count*SurfaceArea(side_bounds) + right_count[i+1]*right_area[i+1])*inv_area;
+                if(cost < best_cost) best_cost = cost, best_axis = a, best_bin = i;
+            }
+        }
+        if(n <= BVH_MAX_LEAF_SIZE && best_cost >= n) return; // intersecting all primitives is cheaper than splitting
+        this->axis = Axis(best_axis);
+        double lo = centroid_bounds.min_point[best_axis], scale = BVH_NUM_BINS / extent[best_axis];
+        mid = std::partition(prims + this->begin, prims + this->end, [&](int p) {
+            return Min(int((centroids[p][best_axis] - lo)*scale), BVH_NUM_BINS - 1) <= best_bin;
+        }) - prims;
+    }
+
+    this->left  = std::make_unique<BVHNode>(this->begin, mid);
+    this->right = std::make_unique<BVHNode>(mid, this->end);
+    if(Min(mid - this->begin, this->end - mid) >= PARALLEL_SUBTREE_SIZE) {
+        // the children cover disjoint ranges of the index array, so they can be built concurrently
+        TaskGroup group;
+        group.Run([&]() { this->left->Split(boxes, centroids, indices, depth+1); });
+        this->right->Split(boxes, centroids, indices, depth+1);
+        group.Wait();
+    }
+    else {
+        this->left->Split(boxes, centroids, indices, depth+1);
+        this->right->Split(boxes, centroids, indices, depth+1);
+    }
+}
+
+std::unique_ptr<BVHNode> BuildBVHNodes(const PrimitiveSet& primitives, std::vector<int>* indices)
+{
+    std::vector<BBox> boxes(primitives.Size());
+    ParallelFor(0, primitives.Size(), 16384, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) boxes[i] = primitives.Bounds(i);
+    });
+    return BuildBVHNodes(boxes, indices);
+}
+
+std::unique_ptr<BVHNode> BuildBVHNodes(const std::vector<BBox>& boxes, std::vector<int>* indices)
+{
+    int n = boxes.size();
+    std::vector<Vec3> centroids(n);
+    indices->resize(n);
+    ParallelFor(0, n, 16384, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) {
+            centroids[i] = boxes[i].Anchor(Vec3(0.5));
+            (*indices)[i] = i;
+        }
+    });
+    if(n == 0) return nullptr;
+    auto root = std::make_unique<BVHNode>(0, n);
+    root->Split(boxes, centroids, indices, 0);
+    return root;
+}
+
+BVH::BVH(const PrimitiveSet& primitives)
+    : primitives(primitives)
+{
+    double t1 = TimeNow();
+    std::unique_ptr<BVHNode> root = BuildBVHNodes(primitives, &this->indices);
+    if(root) {
+        this->nodes.reserve(root->NumNodes());
+        this->Flatten(root.get());
+    }
+    this->build_cost = this->Cost();
+    double t2 = TimeNow();
+    printf("building bvh from %d primitives... took %f seconds\n", primitives.Size(), t2-t1);
+}
+
+void BVH::Flatten(const BVHNode* node)
+{
+    int node_idx = this->nodes.size();
+    this->nodes.emplace_back();
+    this->nodes[node_idx].bounds = node->bounds;
+    if(!node->left) {
+        this->nodes[node_idx].offset = node->begin;
+        this->nodes[node_idx].num_primitives = node->end - node->begin;
+        return;
+    }
+    this->nodes[node_idx].num_primitives = 0;
+    this->nodes[node_idx].axis = uint8_t(node->axis);
+    this->Flatten(node->left.get());
+    this->nodes[node_idx].offset = this->nodes.size();
+    this->Flatten(node->right.get());
+}
+
+// expected cost of a ray that hits the root according to the surface area heuristic
+double BVH::Cost() const
+{
+    if(this->nodes.empty()) return 0.0;
+    double cost = 0.0;
+    for(const BVHFlatNode& node : this->nodes) {
+        cost += SurfaceArea(node.bounds)*(node.IsLeaf() ? node.num_primitives : BVH_TRAVERSAL_COST);
+    }
+    return cost / SurfaceArea(this->nodes[0].bounds);
+}
+
+bool BVH::Refit()
+{
+    int num_nodes = this->nodes.size();
+    ParallelFor(0, num_nodes, 4096, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) {
+            BVHFlatNode& node = this->nodes[i];
+            if(!node.IsLeaf()) continue;
+            const int* prims = &this->indices[node.offset];
+            BBox bounds = this->primitives.Bounds(prims[0]);
+            for(int j = 1; j < node.num_primitives; ++j) bounds = bounds.Union(this->primitives.Bounds(prims[j]));
+            node.bounds = bounds;
+        }
+    });
+    // children are stored after their parent, so a backwards sweep updates them first
+    for(int i = num_nodes - 1; i >= 0; --i) {
+        BVHFlatNode& node = this->nodes[i];
+        if(!node.IsLeaf()) node.bounds = BBox(this->nodes[i + 1].bounds).Union(this->nodes[node.offset].bounds);
+    }
+    return this->Cost() <= BVH_MAX_REFIT_COST*this->build_cost;
+}
+
+// visits the leaves whose bounds are pierced by the ray, roughly front-to-back. intersect_leaf returns the distance
+// up to which the ray still has to be traced, a negative distance stops the traversal
+template<typename LeafFunc>
+void BVH::Traverse(const Ray& r, double tlimit, TraversalCounter* counter, LeafFunc intersect_leaf) const
+{
+    if(this->nodes.empty()) return;
+    Vec3 inv_dir = Vec3(1.0) / r.direction;
+    bool dir_is_neg[3] = { inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0 };
+    int todo[BVH_MAX_DEPTH];
+    int todo_size = 0, node_idx = 0;
+    while(true) {
+        const BVHFlatNode& node = this->nodes[node_idx];
+        counter->nodes_visited++;
+        if(IntersectBounds(node.bounds, r.origin, inv_dir, tlimit)) {
+            if(!node.IsLeaf()) {
+                // visit the child on the near side of the split axis first
+                if(dir_is_neg[node.axis]) todo[todo_size++] = node_idx + 1, node_idx = node.offset;
+                else todo[todo_size++] = node.offset, node_idx = node_idx + 1;
+                continue;
+            }
+            tlimit = intersect_leaf(node);
+            if(tlimit < 0) break;
+        }
+        if(todo_size == 0) break;
+        node_idx = todo[--todo_size];
+    }
+}
+
+bool BVH::Intersect(const Ray& r, Hit* h) const
+{
+    bool did_hit = false;
+    TraversalCounter counter;
+    this->Traverse(r, h->t, &counter, [&](const BVHFlatNode& leaf) {
+        const int* prims = &this->indices[leaf.offset];
+        counter.primitives_tested += leaf.num_primitives;
+        for(int i = 0; i < leaf.num_primitives; ++i) {
+            if(this->primitives.Intersect(prims[i], r, h)) did_hit = true;
+        }
+        return h->t;
+    });
+    return did_hit;
+}
+
+bool BVH::IntersectAny(const Ray& r, double tmax) const
+{
+    bool occluded = false;
+    TraversalCounter counter;
+    this->Traverse(r, tmax, &counter, [&](const BVHFlatNode& leaf) {
+        const int* prims = &this->indices[leaf.offset];
+        for(int i = 0; i < leaf.num_primitives; ++i) {
+            counter.primitives_tested++;
+            if(this->primitives.Occludes(prims[i], r, tmax)) {
+                occluded = true;
+                return -M_INF;
+            }
+        }
+        return tmax;
+    });
+    return occluded;
+}
+
+// subtree that still has to be visited by the rays in mask
+struct BVHPacketTodo {
+    int node_idx;
+    unsigned mask;
+};
+
+void BVH::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
+    if(this->nodes.empty()) return;
+    // rays with different direction signs disagree on the order of the children, so they are traced one by one
+    if(!p.Coherent(mask)) return Accelerator::IntersectPacket(p, hits, mask);
+
+    RayPacketSoA rays(p, mask);
+    alignas(16) double tlimit[RAY_PACKET_SIZE];
+    for(int i = 0; i < RAY_PACKET_SIZE; ++i) tlimit[i] = (mask >> i) & 1 ? hits[i].t : -M_INF;
+    const Vec3& dir = p.rays[__builtin_ctz(mask)].direction;
+    bool dir_is_neg[3] = { dir.x < 0, dir.y < 0, dir.z < 0 };
+    BVHPacketTodo todo[BVH_MAX_DEPTH];
+    int todo_size = 0, node_idx = 0;
+    TraversalCounter counter; // counts a node or primitive once per ray that visits it
+    while(true) {
+        const BVHFlatNode& node = this->nodes[node_idx];
+        counter.nodes_visited += __builtin_popcount(mask);
+        unsigned hit_mask = IntersectBounds(node.bounds, rays, tlimit, mask);
+        if(hit_mask) {
+            if(!node.IsLeaf()) {
+                // visit the child on the near side of the split axis first
+                if(dir_is_neg[node.axis]) todo[todo_size++] = { node_idx + 1, hit_mask }, node_idx = node.offset;
+                else todo[todo_size++] = { int(node.offset), hit_mask }, node_idx = node_idx + 1;
+                mask = hit_mask;
+                continue;
+            }
+            const int* prims = &this->indices[node.offset];
+            counter.primitives_tested += node.num_primitives*__builtin_popcount(hit_mask);
+            for(int i = 0; i < node.num_primitives; ++i) {
+                this->primitives.IntersectPacket(prims[i], p, hits, hit_mask);
+            }
+            for(int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                if((hit_mask >> i) & 1) tlimit[i] = hits[i].t;
+            }
+        }
+        if(todo_size == 0) break;
+        node_idx = todo[--todo_size].node_idx, mask = todo[todo_size].mask;
+    }
+}
+
+BBox BVH::GetBBox() const
+{
+    return this->nodes.empty() ? BBox() : BBox(this->nodes[0].bounds);
+}
+
+void BVH::Save(BinaryWriter* writer) const
+{
+    writer->WriteArray(this->nodes);
+    writer->WriteArray(this->indices);
+    writer->Write(this->build_cost);
+}
+
+std::unique_ptr<BVH> BVH::Load(const PrimitiveSet& primitives, BinaryReader* reader)
+{
+    std::unique_ptr<BVH> tree(new BVH());
+    tree->primitives = primitives;
+    if(!reader->ReadArray(&tree->nodes) || !reader->ReadArray(&tree->indices) || !reader->Read(&tree->build_cost)) return nullptr;
+    for(int idx : tree->indices) {
+        if(idx < 0 || idx >= primitives.Size()) return nullptr;
+    }
+    // a corrupt file must not make the traversal read outside of the arrays or overflow its stack. the children of
+    // every interior node follow it, and each node but the root is the child of exactly one node
+    std::vector<int> depth(tree->nodes.size(), -1);
+    if(!depth.empty()) depth[0] = 0;
+    for(uint32_t i = 0; i < tree->nodes.size(); ++i) {
+        const BVHFlatNode& node = tree->nodes[i];
+        if(depth[i] < 0) return nullptr;
+        if(node.IsLeaf()) {
+            if(uint64_t(node.offset) + node.num_primitives > tree->indices.size()) return nullptr;
+            continue;
+        }
+        if(depth[i] >= BVH_MAX_DEPTH || node.axis > 2 || node.offset <= i + 1 || node.offset >= tree->nodes.size() ||
+           depth[i + 1] >= 0 || depth[node.offset] >= 0) return nullptr;
+        depth[i + 1] = depth[node.offset] = depth[i] + 1;
+    }
+    return tree;
+}
@@ -0,0 +1,366 @@
+#include "bvh4.h"
+
+#include "utils.h"
+#include "surface.h"
+#include "hit.h"
+#include "stats.h"
+#include "ray.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// widens the ray segment to make up for the rounding errors of the single precision slab test
+static constexpr float SLAB_EPS = 1e-6f;
+
+void BVH4Node::SetChild(int i, const BBox& bounds, int32_t child, uint32_t num_primitives)
+{
+    this->min_x[i] = RoundDown(bounds.min_point.x), this->max_x[i] = RoundUp(bounds.max_point.x);
+    this->min_y[i] = RoundDown(bounds.min_point.y), this->max_y[i] = RoundUp(bounds.max_point.y);
+    this->min_z[i] = RoundDown(bounds.min_point.z), this->max_z[i] = RoundUp(bounds.max_point.z);
+    this->children[i] = child;
+    this->num_primitives[i] = num_primitives;
+}
+
+BBox BVH4Node::ChildBounds(int i) const
+{
+    return { Vec3(this->min_x[i], this->min_y[i], this->min_z[i]), Vec3(this->max_x[i], this->max_y[i], this->max_z[i]) };
+}
+
+void BVH4Node::SetEmpty(int i)
+{
+    this->min_x[i] = this->min_y[i] = this->min_z[i] = INFINITY;
+    this->max_x[i] = this->max_y[i] = this->max_z[i] = -INFINITY;
+    this->children[i] = -1;
+    this->num_primitives[i] = 0;
+}
+
+static inline double SurfaceArea(const BBox& b)
+{
+    Vec3 size = b.Size();
+    return 2.0*(size.x*size.y + size.y*size.z + size.z*size.x);
+}
+
+BVH4::BVH4(const PrimitiveSet& primitives)
+    : primitives(primitives)
+{
+    double t1 = TimeNow();
+    std::unique_ptr<BVHNode> root = BuildBVHNodes(primitives, &this->indices);
+    if(root) {
+        this->bbox = root->bounds;
+        if(root->left) this->Collapse(root.get());
+        else { // a single leaf still needs a node to live in
+            this->nodes.emplace_back();
+            this->nodes[0].SetChild(0, root->bounds, root->begin, root->end - root->begin);
+            for(int i = 1; i < 4; ++i) this->nodes[0].SetEmpty(i);
+        }
+    }
+    this->build_cost = this->Cost();
+    double t2 = TimeNow();
+    printf("building 4-wide bvh from %d primitives... took %f seconds\n", primitives.Size(), t2-t1);
+}
+
+int BVH4::Collapse(const BVHNode* node)
+{
+    // pull up grandchildren until there are four children, always opening the largest interior child
+    const BVHNode* children[4] = { node->left.get(), node->right.get() };
+    int num_children = 2;
+    while(num_children < 4) {
+        int best = -1;
+        double best_area = -1;
+        for(int i = 0; i < num_children; ++i) {
+            double area = SurfaceArea(children[i]->bounds);
+            if(children[i]->left && area > best_area) best = i, best_area = area;
+        }
+        if(best < 0) break;
+        const BVHNode* c = children[best];
+        children[best] = c->left.get(), children[num_children++] = c->right.get();
+    }
+    int node_idx = this->nodes.size();
+    this->nodes.emplace_back();
+    for(int i = 0; i < 4; ++i) {
+        if(i >= num_children) this->nodes[node_idx].SetEmpty(i);
+        else if(!children[i]->left) this->nodes[node_idx].SetChild(i, children[i]->bounds, children[i]->begin, children[i]->end - children[i]->begin);
+        else {
+            int child_idx = this->Collapse(children[i]);
+            this->nodes[node_idx].SetChild(i, children[i]->bounds, child_idx, 0);
+        }
+    }
+    return node_idx;
+}
+
+// expected cost of a ray that hits the root according to the surface area heuristic
+double BVH4::Cost() const
+{
+    if(this->nodes.empty()) return 0.0;
+    double cost = SurfaceArea(this->bbox)*BVH_TRAVERSAL_COST;
+    for(const BVH4Node& node : this->nodes) {
+        for(int i = 0; i < 4; ++i) {
+            if(node.children[i] < 0) continue;
+            double area = SurfaceArea(node.ChildBounds(i));
+            cost += area*(node.num_primitives[i] > 0 ? node.num_primitives[i] : BVH_TRAVERSAL_COST);
+        }
+    }
+    return cost / SurfaceArea(this->bbox);
+}
+
+bool BVH4::Refit()
+{
+    // children are stored after their parent, so a backwards sweep updates them first
+    std::vector<BBox> node_bounds(this->nodes.size());
+    for(int i = int(this->nodes.size()) - 1; i >= 0; --i) {
+        BVH4Node& node = this->nodes[i];
+        bool first = true;
+        for(int j = 0; j < 4; ++j) {
+            if(node.children[j] < 0) continue;
+            BBox b;
+            if(node.num_primitives[j] > 0) {
+                const int* prims = &this->indices[node.children[j]];
+                b = this->primitives.Bounds(prims[0]);
+                for(unsigned k = 1; k < node.num_primitives[j]; ++k) b = b.Union(this->primitives.Bounds(prims[k]));
+            }
+            else b = node_bounds[node.children[j]];
+            node.SetChild(j, b, node.children[j], node.num_primitives[j]);
+            node_bounds[i] = first ? b : node_bounds[i].Union(b);
+            first = false;
+        }
+    }
+    if(!this->nodes.empty()) this->bbox = node_bounds[0];
+    return this->Cost() <= BVH_MAX_REFIT_COST*this->build_cost;
+}
+
+// ray prepared for the single precision slab test against the four children of a node
+struct BVH4Ray {
+#ifdef __SSE__
+    __m128 origin[3], inv_dir[3];
+#else
+    float origin[3], inv_dir[3];
+#endif
+
+    BVH4Ray() = default;
+    BVH4Ray(const Ray& r);
+    // returns a bitmask of the children whose bounds the ray enters before tlimit. the entry distances are stored in
+    // tnear, which has to be 16 byte aligned
+    int IntersectChildren(const BVH4Node& node, double tlimit, float* tnear) const;
+};
+
+BVH4Ray::BVH4Ray(const Ray& r)
+{
+    Vec3 inv = Vec3(1.0) / r.direction;
+#ifdef __SSE__
+    this->origin[0] = _mm_set1_ps(r.origin.x), this->origin[1] = _mm_set1_ps(r.origin.y), this->origin[2] = _mm_set1_ps(r.origin.z);
+    this->inv_dir[0] = _mm_set1_ps(inv.x), this->inv_dir[1] = _mm_set1_ps(inv.y), this->inv_dir[2] = _mm_set1_ps(inv.z);
+#else
+    this->origin[0] = r.origin.x, this->origin[1] = r.origin.y, this->origin[2] = r.origin.z;
+    this->inv_dir[0] = inv.x, this->inv_dir[1] = inv.y, this->inv_dir[2] = inv.z;
+#endif
+}
+
+inline int BVH4Ray::IntersectChildren(const BVH4Node& node, double tlimit, float* tnear) const
+{
+#ifdef __SSE__
+    const __m128 near_scale = _mm_set1_ps(1.0f - SLAB_EPS), far_scale = _mm_set1_ps(1.0f + SLAB_EPS);
+    const __m128 *o = this->origin, *id = this->inv_dir;
+    __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), o[0]), id[0]), tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), o[0]), id[0]);
+    __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), o[1]), id[1]), ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), o[1]), id[1]);
+    __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), o[2]), id[2]), tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), o[2]), id[2]);
+    __m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+    __m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(tlimit)));
+    t0 = _mm_mul_ps(t0, near_scale), t1 = _mm_mul_ps(t1, far_scale);
+    _mm_store_ps(tnear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    const float* mins[3] = { node.min_x, node.min_y, node.min_z };
+    const float* maxs[3] = { node.max_x, node.max_y, node.max_z };
+    for(int i = 0; i < 4; ++i) {
+        float t0 = 0.0f, t1 = float(tlimit);
+        for(int a = 0; a < 3; ++a) {
+            float ta = (mins[a][i] - this->origin[a])*this->inv_dir[a], tb = (maxs[a][i] - this->origin[a])*this->inv_dir[a];
+            t0 = Max(t0, Min(ta, tb)), t1 = Min(t1, Max(ta, tb));
+        }
+        tnear[i] = t0*(1.0f - SLAB_EPS);
+        if(tnear[i] <= t1*(1.0f + SLAB_EPS)) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+// child that still has to be visited
+struct BVH4Todo {
+    int32_t child;
+    uint32_t num_primitives;
+    float tnear; // entry distance into the bounds of the child
+};
+
+// visits the leaves whose bounds are pierced by the ray, the children of every node in front-to-back order.
+// intersect_leaf returns the distance up to which the ray still has to be traced, a negative distance stops the traversal
+template<typename LeafFunc>
+void BVH4::Traverse(const Ray& r, double tlimit, TraversalCounter* counter, LeafFunc intersect_leaf) const
+{
+    if(this->nodes.empty()) return;
+    BVH4Ray ray(r);
+    BVH4Todo todo[BVH4_STACK_SIZE];
+    int todo_size = 0;
+    todo[todo_size++] = { 0, 0, 0.0f };
+    while(todo_size > 0) {
+        BVH4Todo cur = todo[--todo_size];
+        // a closer hit found since the child was pushed may already end the ray in front of it
+        if(cur.tnear > tlimit) continue;
+        if(cur.num_primitives > 0) {
+            tlimit = intersect_leaf(cur.child, cur.num_primitives);
+            if(tlimit < 0) break;
+            continue;
+        }
+        const BVH4Node& node = this->nodes[cur.child];
+        counter->nodes_visited++;
+        alignas(16) float tnear[4];
+        int mask = ray.IntersectChildren(node, tlimit, tnear);
+        // push the hit children sorted far to near, so that the nearest one ends up on top of the stack
+        int base = todo_size;
+        for(int i = 0; i < 4; ++i) {
+            if(!(mask & (1 << i)) || node.children[i] < 0) continue;
+            int j = todo_size++;
+            for(; j > base && todo[j-1].tnear < tnear[i]; --j) todo[j] = todo[j-1];
+            todo[j] = { node.children[i], node.num_primitives[i], tnear[i] };
+        }
+    }
+}
+
+bool BVH4::Intersect(const Ray& r, Hit* h) const
+{
+    bool did_hit = false;
+    TraversalCounter counter;
+    this->Traverse(r, h->t, &counter, [&](int offset, int num_primitives) {
+        const int* prims = &this->indices[offset];
+        counter.primitives_tested += num_primitives;
+        for(int i = 0; i < num_primitives; ++i) {
+            if(this->primitives.Intersect(prims[i], r, h)) did_hit = true;
+        }
+        return h->t;
+    });
+    return did_hit;
+}
+
+bool BVH4::IntersectAny(const Ray& r, double tmax) const
+{
+    bool occluded = false;
+    TraversalCounter counter;
+    this->Traverse(r, tmax, &counter, [&](int offset, int num_primitives) {
+        const int* prims = &this->indices[offset];
+        for(int i = 0; i < num_primitives; ++i) {
+            counter.primitives_tested++;
+            if(this->primitives.Occludes(prims[i], r, tmax)) {
+                occluded = true;
+                return -M_INF;
+            }
+        }
+        return tmax;
+    });
+    return occluded;
+}
+
+// child that still has to be visited by the rays in mask
+struct BVH4PacketTodo {
+    int32_t child;
+    uint32_t num_primitives;
+    unsigned mask;
+    float tnear; // smallest entry distance of the rays into the bounds of the child
+};
+
+// the rays of the packet are tested one by one against the children of a node, but share the stack and visit the
+// leaves together, so that the blocks of a leaf are tested against all of its rays at once
+void BVH4::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
+    if(this->nodes.empty()) return;
+    // rays with different direction signs disagree on the order of the children, so they are traced one by one
+    if(!p.Coherent(mask)) return Accelerator::IntersectPacket(p, hits, mask);
+
+    BVH4Ray rays[RAY_PACKET_SIZE];
+    for(int k = 0; k < RAY_PACKET_SIZE; ++k) {
+        if((mask >> k) & 1) rays[k] = BVH4Ray(p.rays[k]);
+    }
+    BVH4PacketTodo todo[BVH4_STACK_SIZE];
+    int todo_size = 0;
+    todo[todo_size++] = { 0, 0, mask, 0.0f };
+    TraversalCounter counter; // counts a node or primitive once per ray that visits it
+    while(todo_size > 0) {
+        BVH4PacketTodo cur = todo[--todo_size];
+        // drop the rays that found a hit in front of the child since it was pushed
+        unsigned cur_mask = 0;
+        for(unsigned m = cur.mask; m; m &= m - 1) {
+            int k = __builtin_ctz(m);
+            if(hits[k].t >= cur.tnear) cur_mask |= 1u << k;
+        }
+        if(!cur_mask) continue;
+        if(cur.num_primitives > 0) {
+            const int* prims = &this->indices[cur.child];
+            counter.primitives_tested += cur.num_primitives*__builtin_popcount(cur_mask);
+            for(uint32_t i = 0; i < cur.num_primitives; ++i) this->primitives.IntersectPacket(prims[i], p, hits, cur_mask);
+            continue;
+        }
+        const BVH4Node& node = this->nodes[cur.child];
+        counter.nodes_visited += __builtin_popcount(cur_mask);
+        unsigned child_mask[4] = {};
+        float child_tnear[4];
+        for(unsigned m = cur_mask; m; m &= m - 1) {
+            int k = __builtin_ctz(m);
+            alignas(16) float tnear[4];
+            int hit = rays[k].IntersectChildren(node, hits[k].t, tnear);
+            for(int i = 0; i < 4; ++i) {
+                if(!(hit & (1 << i))) continue;
+                child_tnear[i] = child_mask[i] ? Min(child_tnear[i], tnear[i]) : tnear[i];
+                child_mask[i] |= 1u << k;
+            }
+        }
+        // push the hit children sorted far to near, so that the nearest one ends up on top of the stack
+        int base = todo_size;
+        for(int i = 0; i < 4; ++i) {
+            if(!child_mask[i] || node.children[i] < 0) continue;
+            int j = todo_size++;
+            for(; j > base && todo[j-1].tnear < child_tnear[i]; --j) todo[j] = todo[j-1];
+            todo[j] = { node.children[i], node.num_primitives[i], child_mask[i], child_tnear[i] };
+        }
+    }
+}
+
+void BVH4::Save(BinaryWriter* writer) const
+{
+    writer->Write(this->bbox);
+    writer->WriteArray(this->nodes);
+    writer->WriteArray(this->indices);
+    writer->Write(this->build_cost);
+}
+
+std::unique_ptr<BVH4> BVH4::Load(const PrimitiveSet& primitives, BinaryReader* reader)
+{
+    std::unique_ptr<BVH4> tree(new BVH4());
+    tree->primitives = primitives;
+    if(!reader->Read(&tree->bbox) || !reader->ReadArray(&tree->nodes) || !reader->ReadArray(&tree->indices) || !reader->Read(&tree->build_cost)) return nullptr;
+    for(int idx : tree->indices) {
+        if(idx < 0 || idx >= primitives.Size()) return nullptr;
+    }
+    // a corrupt file must not make the traversal read outside of the arrays or overflow its stack. interior children
+    // follow their parent, and each node but the root is the child of exactly one node
+    std::vector<int> depth(tree->nodes.size(), -1);
+    if(!depth.empty()) depth[0] = 0;
+    for(uint32_t i = 0; i < tree->nodes.size(); ++i) {
+        const BVH4Node& node = tree->nodes[i];
+        if(depth[i] < 0 || depth[i] >= BVH_MAX_DEPTH) return nullptr;
+        for(int j = 0; j < 4; ++j) {
+            int32_t child = node.children[j];
+            if(child < 0) continue;
+            if(node.num_primitives[j] > 0) {
+                if(uint64_t(child) + node.num_primitives[j] > tree->indices.size()) return nullptr;
+                continue;
+            }
+            if(uint32_t(child) <= i || uint32_t(child) >= tree->nodes.size() || depth[child] >= 0) return nullptr;
+            depth[child] = depth[i] + 1;
+        }
+    }
+    return tree;
+}
@@ -0,0 +1,129 @@
+#include "cache.h"
+
+#include "mesh.h"
+#include "import.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char CACHE_MAGIC[8] = { 'G', 'I', 'C', 'A', 'C', 'H', 'E', '\0' };
+
+uint64_t HashFNV1a(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// read-only memory mapping of a whole file, empty if the file could not be mapped
+struct MappedFile {
+    void* data = nullptr;
+    size_t size = 0;
+
+    MappedFile(const char* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if(fd < 0) return;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) this->data = p, this->size = st.st_size;
+        }
+        close(fd);
+    }
+    ~MappedFile() { if(this->data) munmap(this->data, this->size); }
+};
+
+static uint64_t CacheKey(const MappedFile& input, AcceleratorType type, const KDBuildParams& params)
+{
+    // the build parameters are hashed member by member, their padding bytes are undefined
+    uint64_t hash = HashFNV1a(&CACHE_VERSION, sizeof(CACHE_VERSION));
+    hash = HashFNV1a(input.data, input.size, hash);
+    hash = HashFNV1a(&type, sizeof(type), hash);
+#ifdef EMBREE
+    hash = HashFNV1a("embree", 6, hash);
+#endif
+#ifdef SINGLE_PRECISION
+    hash = HashFNV1a("single", 6, hash);
+#endif
+    if(type == AcceleratorType::KDTREE) {
+        hash = HashFNV1a(&params.method, sizeof(params.method), hash);
+        hash = HashFNV1a(&params.traversal_cost, sizeof(params.traversal_cost), hash);
+        hash = HashFNV1a(&params.intersection_cost, sizeof(params.intersection_cost), hash);
+        hash = HashFNV1a(&params.empty_bonus, sizeof(params.empty_bonus), hash);
+        hash = HashFNV1a(&params.num_bins, sizeof(params.num_bins), hash);
+        hash = HashFNV1a(&params.max_depth, sizeof(params.max_depth), hash);
+    }
+    return hash;
+}
+
+static std::shared_ptr<Mesh> LoadCacheFile(const char* path, uint64_t key, Material* material)
+{
+    MappedFile file(path);
+    if(!file.data) return nullptr;
+    BinaryReader reader(file.data, file.size);
+    char magic[8];
+    uint32_t version;
+    uint64_t file_key;
+    if(!reader.Read(&magic) || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0) return nullptr;
+    if(!reader.Read(&version) || version != CACHE_VERSION || !reader.Read(&file_key) || file_key != key) return nullptr;
+    return Mesh::Load(&reader, material);
+}
+
+static bool WriteCacheFile(const char* path, const BinaryWriter& writer)
+{
+    // written under a temporary name first, so that concurrent processes never map a partially written file
+    std::string tmp_path = std::string(path) + ".tmp" + std::to_string(getpid());
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if(!fp) return false;
+    bool ok = fwrite(writer.data.data(), 1, writer.data.size(), fp) == writer.data.size();
+    ok = fclose(fp) == 0 && ok;
+    if(ok) ok = rename(tmp_path.c_str(), path) == 0;
+    if(!ok) remove(tmp_path.c_str());
+    return ok;
+}
+
+std::shared_ptr<Mesh> ReadSTLCached(const char* path, Material* material, const char* cache_dir, AcceleratorType type, const KDBuildParams& params)
+{
+    uint64_t key;
+    {
+        MappedFile input(path);
+        if(!input.data) return nullptr;
+        key = CacheKey(input, type, params);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.gicache", (unsigned long long)key);
+    std::string cache_path = std::string(cache_dir) + name;
+
+    double t1 = TimeNow();
+    std::shared_ptr<Mesh> mesh = LoadCacheFile(cache_path.c_str(), key, material);
+    if(mesh) {
+        double t2 = TimeNow();
+        printf("loading %s from cache %s... took %f seconds\n", path, cache_path.c_str(), t2-t1);
+        return mesh;
+    }
+
+    mesh = ReadSTL(path, material);
+    if(!mesh) {
+        fprintf(stderr, "could not read %s\n", path);
+        return nullptr;
+    }
+    mesh->SetAccelerator(type);
+    mesh->SetKDBuildParams(params);
+    BinaryWriter writer;
+    writer.Write(CACHE_MAGIC);
+    writer.Write(CACHE_VERSION);
+    writer.Write(key);
+    mesh->Save(&writer);
+    mkdir(cache_dir, 0755);
+    if(!WriteCacheFile(cache_path.c_str(), writer)) fprintf(stderr, "could not write mesh cache %s\n", cache_path.c_str());
+    return mesh;
+}
@@ -2,11 +2,23 @@
 
 #include "ray.h"
 #include "surface.h"
+#include "instance.h"
 
 void Hit::RecordHit(double t, const Surface* s)
 {
     this->s = s;
+    this->instance = nullptr;
     this->t = t;
+    this->prim = -1;
+}
+
+void Hit::RecordHit(double t, const Surface* s, int prim, double b1, double b2)
+{
+    this->s = s;
+    this->instance = nullptr;
+    this->t = t;
+    this->prim = prim;
+    this->b1 = b1, this->b2 = b2;
 }
 
 HitRecord Hit::GetRecord(const Ray& r)
@@ -15,12 +27,13 @@ HitRecord Hit::GetRecord(const Ray& r)
     double t = this->t;
     const Surface* s = this->s;
 
+    // surfaces of instances are evaluated in object space, only the normal is transformed back
+    Vec3 p = this->instance ? this->instance->ToObject(r).PositionAt(t) : r.PositionAt(t);
+
     hr.t            = t;
     hr.position     = r.PositionAt(t);
-    hr.normal       = s->NormalAt(hr.position);
-    hr.material     = s->MaterialAt(hr.position);
-    Vec3 uv         = s->UV(hr.position);
-    hr.u = uv.u, hr.v = uv.v;
+    s->FillRecord(*this, p, &hr);
+    if(this->instance) hr.normal = this->instance->NormalToWorld(hr.normal);
 
     return hr;
 }
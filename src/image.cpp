@@ -6,14 +6,28 @@
 #include "stb_image_write.h"
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
 constexpr double GAMMA_INV = 1.0 / 2.2;
+constexpr char SUMS_MAGIC[8] = { 'g', 'i', 's', 'u', 'm', 's', '1', '\n' };
 
 void Image::AddPixel(int x, int y, const Rgb& val)
 {
     Pixel* p = &this->data[y*width + x];
+    p->sum += val;
     p->num_samples++;
-    p->val = p->val + (val - p->val) / p->num_samples; // x_hat' = (n*x_hat + x_new) / (n+1)
+}
+
+void Image::AddBlock(int x0, int y0, int w, int h, const Rgb* sums, int num_samples)
+{
+    for(int y = 0; y < h; ++y) {
+        Pixel* row = &this->data[(y0 + y)*width + x0];
+        for(int x = 0; x < w; ++x) {
+            row[x].sum += sums[y*w + x];
+            row[x].num_samples += num_samples;
+        }
+    }
 }
 
 static inline std::vector<unsigned char> GetRgbBytes(const std::vector<Pixel>& pixels)
@@ -21,7 +35,9 @@ static inline std::vector<unsigned char> GetRgbBytes(const std::vector<Pixel>& p
     int n = pixels.size();
     std::vector<unsigned char> bytes(3*n);
     for(int i = 0; i < n; ++i) {
-        Rgb rgb = Pow(pixels[i].val, GAMMA_INV); // gamma correction
+        const Pixel& p = pixels[i];
+        Rgb mean = p.num_samples > 0 ? p.sum / p.num_samples : Rgb(0.0);
+        Rgb rgb = Pow(mean, GAMMA_INV); // gamma correction
         int idx = 3*i;
         bytes[idx]      = (unsigned char)(Clamp(255*rgb[0], 0., 255.));
         bytes[idx + 1]  = (unsigned char)(Clamp(255*rgb[1], 0., 255.));
@@ -53,3 +69,43 @@ bool Image::SavePPM(const char* filename) const
     fclose(fp);
     return true;
 }
+
+// magic, width and height as 32-bit ints, the sums of all pixels as three doubles each, then their sample counts
+bool Image::SaveSums(const char* filename) const
+{
+    FILE* fp = fopen(filename, "wb");
+    if(!fp) return false;
+    int32_t size[2] = { width, height };
+    std::vector<double> sums(3*this->data.size());
+    std::vector<int32_t> counts(this->data.size());
+    for(size_t i = 0; i < this->data.size(); ++i) {
+        for(int c = 0; c < 3; ++c) sums[3*i + c] = this->data[i].sum[c];
+        counts[i] = this->data[i].num_samples;
+    }
+    bool success = fwrite(SUMS_MAGIC, sizeof(SUMS_MAGIC), 1, fp) == 1 && fwrite(size, sizeof(size), 1, fp) == 1
+                   && fwrite(sums.data(), sizeof(double), sums.size(), fp) == sums.size()
+                   && fwrite(counts.data(), sizeof(int32_t), counts.size(), fp) == counts.size();
+    fclose(fp);
+    return success;
+}
+
+bool Image::AddSums(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(!fp) return false;
+    char magic[sizeof(SUMS_MAGIC)];
+    int32_t size[2];
+    std::vector<double> sums(3*this->data.size());
+    std::vector<int32_t> counts(this->data.size());
+    bool success = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, SUMS_MAGIC, sizeof(magic)) == 0
+                   && fread(size, sizeof(size), 1, fp) == 1 && size[0] == width && size[1] == height
+                   && fread(sums.data(), sizeof(double), sums.size(), fp) == sums.size()
+                   && fread(counts.data(), sizeof(int32_t), counts.size(), fp) == counts.size();
+    fclose(fp);
+    if(!success) return false;
+    for(size_t i = 0; i < this->data.size(); ++i) {
+        this->data[i].sum += Rgb(sums[3*i], sums[3*i + 1], sums[3*i + 2]);
+        this->data[i].num_samples += counts[i];
+    }
+    return true;
+}
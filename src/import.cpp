@@ -19,13 +19,21 @@ static inline void IncrementFilePointer(FILE* fp, int offset) { fseek(fp, offset
 std::shared_ptr<Mesh> ReadSTL(const char* path, Material* material)
 {
     FILE* fp = fopen(path, "rb");
+    if(!fp) return nullptr;
     int num_bytes = FileSize(fp);
+    if(num_bytes < 84) {
+        fclose(fp);
+        return nullptr;
+    }
     int num_triangles = (num_bytes - 84) / 50; // 84 header bytes, 50 bytes per triangle
     std::vector<Vec3> vertices(3*num_triangles);
     IncrementFilePointer(fp, 96); // skip 84 bytes header + 12 bytes of first triangle normal
     float buf[9];
     for(int i = 0; i < num_triangles; ++i) {
-        fread(buf, sizeof(float), 9, fp); // triangle vertices
+        if(fread(buf, sizeof(float), 9, fp) != 9) { // triangle vertices
+            fclose(fp);
+            return nullptr;
+        }
         int idx = 3*i;
         vertices[idx + 0] = { buf[0], buf[1], buf[2] };
         vertices[idx + 1] = { buf[3], buf[4], buf[5] };
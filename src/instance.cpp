@@ -0,0 +1,83 @@
+#include "instance.h"
+
+#include "mesh.h"
+#include "hit.h"
+#include "ray.h"
+
+Instance::Instance(const std::shared_ptr<Mesh>& mesh, const Mat4& transform)
+    : mesh(mesh)
+{
+    this->SetTransform(transform);
+}
+
+void Instance::SetTransform(const Mat4& transform)
+{
+    this->transform = transform;
+    this->inv_transform = Inverse(transform);
+    this->normal_transform = Transpose(this->inv_transform);
+    this->bbox.reset();
+}
+
+BBox Instance::GetBBox()
+{
+    if(!this->bbox) this->Build();
+    return *this->bbox;
+}
+
+bool Instance::Intersect(const Ray& r, Hit* h) const
+{
+    if(!this->mesh->Intersect(this->ToObject(r), h)) return false;
+    h->instance = this;
+    return true;
+}
+
+bool Instance::Occludes(const Ray& r, double tmax) const
+{
+    return this->mesh->Occludes(this->ToObject(r), tmax);
+}
+
+void Instance::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
+    RayPacket local;
+    local.size = p.size;
+    const Instance* prev[RAY_PACKET_SIZE];
+    for(int i = 0; i < p.size; ++i) {
+        local.rays[i] = this->ToObject(p.rays[i]);
+        // RecordHit clears the instance, which tells the rays that hit the mesh apart from the others
+        prev[i] = hits[i].instance, hits[i].instance = this;
+    }
+    this->mesh->IntersectPacket(local, hits, mask);
+    for(int i = 0; i < p.size; ++i) {
+        hits[i].instance = hits[i].instance == nullptr ? this : prev[i];
+    }
+}
+
+void Instance::Build()
+{
+    this->mesh->Build();
+    {
+        // bounds of the transformed corners of the mesh bounds, recomputed since the mesh may have been deformed
+        BBox b = this->mesh->GetBBox();
+        Vec3 min = Vec3(M_INF), max = Vec3(-M_INF);
+        for(int i = 0; i < 8; ++i) {
+            Vec3 corner = {
+                i & 1 ? b.max_point.x : b.min_point.x,
+                i & 2 ? b.max_point.y : b.min_point.y,
+                i & 4 ? b.max_point.z : b.min_point.z
+            };
+            Vec3 p = this->transform.MultiplyPosition(corner);
+            min = Min(min, p), max = Max(max, p);
+        }
+        this->bbox = std::make_unique<BBox>(min, max);
+    }
+}
+
+Ray Instance::ToObject(const Ray& r) const
+{
+    return Ray(this->inv_transform.MultiplyPosition(r.origin), this->inv_transform.MultiplyVector(r.direction));
+}
+
+Vec3 Instance::NormalToWorld(const Vec3& n) const
+{
+    return this->normal_transform.MultiplyDirection(n);
+}
@@ -3,10 +3,14 @@
 #include "utils.h"
 #include "surface.h"
 #include "hit.h"
+#include "stats.h"
 #include "ray.h"
+#include "cache.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
 #include <algorithm>
+#include <math.h>
 
 static inline double Median(std::vector<double>& v)
 {
@@ -20,123 +24,449 @@ static inline double Median(std::vector<double>& v)
     }
 }
 
-void KDNode::Split(int depth)
+// nodes with at least this many surfaces split their per-node passes into parallel chunks
+static constexpr int PARALLEL_CHUNK_SIZE = 16384;
+// children with at least this many surfaces are built as separate tasks
+static constexpr int PARALLEL_SUBTREE_SIZE = 1024;
+
+// surface area of a box, used as the probability of a ray hitting it in the SAH cost function
+static inline double SurfaceArea(const Vec3& size)
 {
-    int n = this->surfaces.size();
-    if(n < 8) return; // too much overhead of tree traversal if there are few primitives in the scene
+    return 2.0*(size.x*size.y + size.y*size.z + size.z*size.x);
+}
+
+bool KDNode::MedianSplit(const std::vector<BBox>& boxes, Axis* axis, double* pos, int* size)
+{
+    int n = this->primitives.size();
+    if(n < 8) return false; // too much overhead of tree traversal if there are few primitives in the scene
     std::vector<double> x(2*n), y(2*n), z(2*n);
-    for(int i = 0; i < n; ++i) {
-        BBox b = this->surfaces[i]->GetBBox();
-        int idx = 2*i;
-        x[idx] = b.min_point.x, x[idx+1] = b.max_point.x;
-        y[idx] = b.min_point.y, y[idx+1] = b.max_point.y;
-        z[idx] = b.min_point.z, z[idx+1] = b.max_point.z;
+    ParallelFor(0, n, PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) {
+            const BBox& b = boxes[this->primitives[i]];
+            int idx = 2*i;
+            x[idx] = b.min_point.x, x[idx+1] = b.max_point.x;
+            y[idx] = b.min_point.y, y[idx+1] = b.max_point.y;
+            z[idx] = b.min_point.z, z[idx+1] = b.max_point.z;
+        }
+    });
+    // calculate medians and partition counts for x,y and z positions
+    double mx, my, mz;
+    int count_x, count_y, count_z;
+    if(n >= PARALLEL_CHUNK_SIZE) {
+        TaskGroup group;
+        group.Run([&]() { mx = Median(x), count_x = this->PartitionCount(boxes, Axis::X, mx); });
+        group.Run([&]() { my = Median(y), count_y = this->PartitionCount(boxes, Axis::Y, my); });
+        mz = Median(z), count_z = this->PartitionCount(boxes, Axis::Z, mz);
+        group.Wait();
+    }
+    else {
+        mx = Median(x), my = Median(y), mz = Median(z);
+        count_x = this->PartitionCount(boxes, Axis::X, mx), count_y = this->PartitionCount(boxes, Axis::Y, my), count_z = this->PartitionCount(boxes, Axis::Z, mz);
     }
-    double mx = Median(x), my = Median(y), mz = Median(z); // calculate medians for x,y and z positions
 
     // best axis based on partition side with fewest points
     int best_size = BALANCING_FACTOR*n;
     Axis best_axis = Axis::NONE;
     double best_pos = 0.0;
-    int count_x = this->PartitionCount(Axis::X, mx), count_y = this->PartitionCount(Axis::Y, my), count_z = this->PartitionCount(Axis::Z, mz);
     if(count_x < best_size) { best_size = count_x, best_axis = Axis::X, best_pos = mx; }
     if(count_y < best_size) { best_size = count_y, best_axis = Axis::Y, best_pos = my; }
     if(count_z < best_size) { best_size = count_z, best_axis = Axis::Z, best_pos = mz; }
-    if(best_axis == Axis::NONE) return; // leaf node
-    std::vector<Surface*> left_surfaces, right_surfaces;
-    this->Partition(best_axis, best_pos, best_size, &left_surfaces, &right_surfaces);
-    this->axis  = best_axis, this->pos = best_pos;
-    this->left  = std::make_unique<KDNode>(left_surfaces);
-    this->right = std::make_unique<KDNode>(right_surfaces);
-    this->left->Split(depth+1);
-    this->right->Split(depth+1);
-    this->surfaces.clear(); // only leaf nodes contains surfaces
+    if(best_axis == Axis::NONE) return false;
+    *axis = best_axis, *pos = best_pos, *size = best_size;
+    return true;
 }
 
-bool KDNode::Intersect(const Ray& r, Hit* h)
+bool KDNode::SAHSplit(const std::vector<BBox>& boxes, const BBox& bounds, const KDBuildParams& params, Axis* axis, double* pos, int* size)
 {
-    Hit tmp;
-    bool did_hit = false;
-    for(Surface* s : this->surfaces) {
-        if(s->Intersect(r, &tmp)){
-            did_hit = true;
-            *h = tmp;
+    int n = this->primitives.size();
+    if(n <= 1) return false;
+    Vec3 extent = bounds.Size();
+    int num_bins = params.num_bins;
+
+    // bin the primitive extents along every axis, clamped to the node bounds.
+    // bins are laid out as [chunk][axis][min/max][bin] so that every chunk can be binned independently
+    int num_chunks = (n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE, chunk_bins = 6*num_bins;
+    std::vector<int> bins(num_chunks*chunk_bins, 0);
+    ParallelFor(0, n, PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+        int* chunk = &bins[(begin / PARALLEL_CHUNK_SIZE)*chunk_bins];
+        for(int i = begin; i < end; ++i) {
+            const BBox& b = boxes[this->primitives[i]];
+            for(int a = 0; a < 3; ++a) {
+                if(extent[a] <= 0) continue;
+                double lo = bounds.min_point[a], scale = num_bins / extent[a];
+                int b0 = Clamp((b.min_point[a] - lo)*scale, 0.0, num_bins-1.0);
+                int b1 = Clamp((b.max_point[a] - lo)*scale, 0.0, num_bins-1.0);
+                chunk[(2*a)*num_bins + b0]++, chunk[(2*a + 1)*num_bins + b1]++;
+            }
         }
+    });
+    for(int c = 1; c < num_chunks; ++c) {
+        for(int i = 0; i < chunk_bins; ++i) bins[i] += bins[c*chunk_bins + i];
     }
-    return did_hit && h->t > M_EPS && h->t < M_INF;
+
+    double inv_area = 1.0 / SurfaceArea(extent);
+    double leaf_cost = params.intersection_cost*n;
+    double best_cost = leaf_cost;
+    Axis best_axis = Axis::NONE;
+    double best_pos = 0.0;
+    for(int a = 0; a < 3; ++a) {
+        double lo = bounds.min_point[a], hi = bounds.max_point[a], width = extent[a];
+        if(width <= 0) continue;
+        const int* min_bins = &bins[(2*a)*num_bins];
+        const int* max_bins = &bins[(2*a + 1)*num_bins];
+        // sweep the bin boundaries as candidate split planes
+        int num_left = 0, num_right = n;
+        for(int i = 1; i < num_bins; ++i) {
+            num_left += min_bins[i-1], num_right -= max_bins[i-1];
+            double p = lo + i*width / num_bins;
+            Vec3 left_size = extent, right_size = extent;
+            left_size.data[a] = p - lo, right_size.data[a] = hi - p;
+            double p_left = SurfaceArea(left_size)*inv_area, p_right = SurfaceArea(right_size)*inv_area;
+            double bonus = (num_left == 0 || num_right == 0) ? params.empty_bonus : 0.0;
+            double cost = params.traversal_cost + params.intersection_cost*(1.0 - bonus)*(p_left*num_left + p_right*num_right);
+            if(cost < best_cost) {
+                best_cost = cost, best_axis = Axis(a), best_pos = p;
+            }
+        }
+    }
+    if(best_axis == Axis::NONE) return false; // splitting is more expensive than intersecting all primitives
+    *axis = best_axis, *pos = best_pos, *size = n;
+    return true;
 }
 
-bool KDNode::Intersect(const Ray& r, double tmin, double tmax, Hit* h)
+void KDNode::Split(const std::vector<BBox>& boxes, const BBox& bounds, int depth, const KDBuildParams& params)
 {
-    double tsplit;
-    bool left_first;
-    switch(this->axis) {
-        case Axis::X:
-            tsplit = (this->pos - r.origin.x) / r.direction.x;
-            left_first = (r.origin.x < this->pos) || (r.origin.x == this->pos && r.direction.x <= 0);
+    if(depth >= KD_MAX_DEPTH) return;
+    Axis best_axis;
+    double best_pos;
+    int best_size;
+    bool should_split = false;
+    switch(params.method) {
+        case KDBuildMethod::MEDIAN:
+            should_split = this->MedianSplit(boxes, &best_axis, &best_pos, &best_size);
             break;
-        case Axis::Y:
-            tsplit = (this->pos - r.origin.y) / r.direction.y;
-            left_first = (r.origin.y < this->pos) || (r.origin.y == this->pos && r.direction.y <= 0);
+        case KDBuildMethod::SAH:
+            should_split = depth < params.max_depth && this->SAHSplit(boxes, bounds, params, &best_axis, &best_pos, &best_size);
             break;
-        case Axis::Z:
-            tsplit = (this->pos - r.origin.z) / r.direction.z;
-            left_first = (r.origin.z < this->pos) || (r.origin.z == this->pos && r.direction.z <= 0);
-            break;
-        case Axis::NONE: default:
-            return this->Intersect(r, h);
     }
-    KDNode* first   = left_first ? this->left.get()   : this->right.get();
-    KDNode* second  = left_first ? this->right.get()  : this->left.get();
-    if(tsplit > tmax || tsplit <= 0) return first->Intersect(r, tmin, tmax, h);
-    else if(tsplit < tmin) return second->Intersect(r, tmin, tmax, h);
+    if(!should_split) return; // leaf node
+    best_pos = float(best_pos); // the flattened nodes store the split in single precision, so partition w.r.t. that value
+    int n = this->primitives.size();
+    std::vector<int> left_primitives, right_primitives;
+    this->Partition(boxes, best_axis, best_pos, best_size, &left_primitives, &right_primitives);
+    // the binned SAH costs are estimates, the plane might not separate any of the primitives
+    if((int)left_primitives.size() == n && (int)right_primitives.size() == n) return;
+    this->axis  = best_axis, this->pos = best_pos;
+    this->left  = std::make_unique<KDNode>(left_primitives);
+    this->right = std::make_unique<KDNode>(right_primitives);
+    this->primitives.clear(); // only leaf nodes contains primitives
+    this->primitives.shrink_to_fit();
+    BBox left_bounds = bounds, right_bounds = bounds;
+    left_bounds.max_point.data[int(best_axis)] = best_pos;
+    right_bounds.min_point.data[int(best_axis)] = best_pos;
+    if(Min(left_primitives.size(), right_primitives.size()) >= PARALLEL_SUBTREE_SIZE) {
+        TaskGroup group;
+        group.Run([&]() { this->left->Split(boxes, left_bounds, depth+1, params); });
+        this->right->Split(boxes, right_bounds, depth+1, params);
+        group.Wait();
+    }
     else {
-        Hit h1, h2;
-        bool did_hit = first->Intersect(r, tmin, tsplit, &h1);
-        if(h1.t < tsplit) *h = h1;
-        else {
-            if(second->Intersect(r, tsplit, Min(tmax, h1.t), &h2)) did_hit = true;
-            *h = h1.t <= h2.t ? h1 : h2;
-        }
-        return did_hit;
+        this->left->Split(boxes, left_bounds, depth+1, params);
+        this->right->Split(boxes, right_bounds, depth+1, params);
     }
 }
 
-int KDNode::Partition(Axis axis, double p, int size, std::vector<Surface*>* left, std::vector<Surface*>* right)
+// partitions primitives[begin:end] w.r.t. the plane, the output vectors are optional
+static void PartitionRange(const std::vector<BBox>& boxes, const std::vector<int>& primitives, int begin, int end, Axis axis, double p,
+        std::vector<int>* left, std::vector<int>* right, int* left_count, int* right_count)
 {
-    int left_count = 0, right_count = 0;
     bool is_left, is_right;
-    if(left) left->reserve(size);
-    if(right) right->reserve(size);
-    for(Surface* s : surfaces) {
-        s->GetBBox().Partition(axis, p, &is_left, &is_right);
+    for(int i = begin; i < end; ++i) {
+        int prim = primitives[i];
+        boxes[prim].Partition(axis, p, &is_left, &is_right);
         if(is_left) {
-            if(left) left->push_back(s);
-            ++left_count;
+            if(left) left->push_back(prim);
+            ++*left_count;
         }
         if(is_right) {
-            if(right) right->push_back(s);
-            ++right_count;
+            if(right) right->push_back(prim);
+            ++*right_count;
         }
     }
+}
+
+int KDNode::Partition(const std::vector<BBox>& boxes, Axis axis, double p, int size, std::vector<int>* left, std::vector<int>* right)
+{
+    int n = this->primitives.size();
+    int left_count = 0, right_count = 0;
+    if(left) left->reserve(size);
+    if(right) right->reserve(size);
+    if(n < 2*PARALLEL_CHUNK_SIZE) {
+        PartitionRange(boxes, this->primitives, 0, n, axis, p, left, right, &left_count, &right_count);
+        return Max(left_count, right_count);
+    }
+    // partition the chunks in parallel and concatenate them afterwards to keep the order deterministic
+    int num_chunks = (n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    std::vector<std::vector<int>> left_chunks(num_chunks), right_chunks(num_chunks);
+    std::vector<int> left_counts(num_chunks, 0), right_counts(num_chunks, 0);
+    ParallelFor(0, n, PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+        int c = begin / PARALLEL_CHUNK_SIZE;
+        PartitionRange(boxes, this->primitives, begin, end, axis, p, left ? &left_chunks[c] : nullptr, right ? &right_chunks[c] : nullptr,
+                &left_counts[c], &right_counts[c]);
+    });
+    for(int c = 0; c < num_chunks; ++c) {
+        left_count += left_counts[c], right_count += right_counts[c];
+        if(left) left->insert(left->end(), left_chunks[c].begin(), left_chunks[c].end());
+        if(right) right->insert(right->end(), right_chunks[c].begin(), right_chunks[c].end());
+    }
     return Max(left_count, right_count);
 }
 
-KDTree::KDTree(const std::vector<Surface*>& surfaces)
+KDTree::KDTree(const PrimitiveSet& primitives, const KDBuildParams& params)
+    : primitives(primitives)
 {
-    printf("building k-d tree from %ld surfaces...", surfaces.size());
     double t1 = TimeNow();
-    this->bbox = SurroundingBBox(surfaces);
-    this->root = std::make_unique<KDNode>(surfaces);
-    this->root->Split(0);
+    int n = primitives.Size();
+    KDBuildParams build_params = params;
+    if(build_params.max_depth < 0) build_params.max_depth = 8 + 1.3*log2(Max(1.0, double(n)));
+    // the bounds are queried many times during the build, so we only fetch them once
+    std::vector<BBox> boxes(n);
+    std::vector<int> prim_indices(n);
+    ParallelFor(0, n, PARALLEL_CHUNK_SIZE, [&](int begin, int end) {
+        for(int i = begin; i < end; ++i) boxes[i] = this->primitives.Bounds(i), prim_indices[i] = i;
+    });
+    this->bbox = SurroundingBBox(boxes);
+    KDNode root(prim_indices);
+    root.Split(boxes, this->bbox, 0, build_params);
+    this->Flatten(&root);
     double t2 = TimeNow();
-    printf(" took %f seconds\n", t2-t1);
+    printf("building k-d tree from %d primitives... took %f seconds\n", n, t2-t1);
 }
 
-bool KDTree::Intersect(const Ray& r, Hit* h)
+void KDTree::Flatten(const KDNode* node)
+{
+    int node_idx = this->nodes.size();
+    this->nodes.emplace_back();
+    if(node->axis == Axis::NONE) {
+        this->nodes[node_idx].InitLeaf(this->indices.size(), node->primitives.size());
+        this->indices.insert(this->indices.end(), node->primitives.begin(), node->primitives.end());
+        return;
+    }
+    this->Flatten(node->left.get());
+    this->nodes[node_idx].InitInterior(node->axis, node->pos, this->nodes.size());
+    this->Flatten(node->right.get());
+}
+
+// leaves are intersected with the whole ray segment up to the closest hit, so a primitive that was tested in an
+// earlier leaf cannot give a closer hit now
+bool KDTree::IntersectLeaf(const KDFlatNode& node, const Ray& r, Hit* h, KDMailbox* mailbox, TraversalCounter* counter) const
+{
+    bool did_hit = false;
+    const int* prims = &this->indices[node.primitive_offset];
+    for(uint32_t i = 0; i < node.NumPrimitives(); ++i) {
+        if(mailbox->Visited(prims[i])) {
+            counter->mailbox_hits++;
+            continue;
+        }
+        counter->primitives_tested++;
+        if(this->primitives.Intersect(prims[i], r, h)) did_hit = true;
+    }
+    return did_hit;
+}
+
+// subtree that still has to be visited, along with the ray segment overlapping it
+struct KDTodo {
+    int node_idx;
+    double tmin, tmax;
+};
+
+// visits the leaves pierced by the ray in front-to-back order. intersect_leaf returns the distance up to which
+// the ray still has to be traced, traversal stops as soon as that distance lies in front of the next node
+template<typename LeafFunc>
+void KDTree::Traverse(const Ray& r, double tlimit, TraversalCounter* counter, LeafFunc intersect_leaf) const
 {
     double tmin, tmax;
     bool hit = this->bbox.Intersect(r, &tmin, &tmax);
-    if(!hit || tmin > tmax || tmax <= 0) return false;
-    return this->root->Intersect(r, tmin, tmax, h);
+    if(!hit || tmin > tmax || tmax <= 0) return;
+
+    Vec3 inv_dir = Vec3(1.0) / r.direction;
+    KDTodo todo[KD_MAX_DEPTH];
+    int todo_size = 0, node_idx = 0;
+    while(tlimit >= tmin) {
+        const KDFlatNode& node = this->nodes[node_idx];
+        counter->nodes_visited++;
+        if(!node.IsLeaf()) {
+            int axis = int(node.SplitAxis());
+            double pos = node.split;
+            double tsplit = (pos - r.origin[axis])*inv_dir[axis];
+            bool left_first = (r.origin[axis] < pos) || (r.origin[axis] == pos && r.direction[axis] <= 0);
+            int first   = left_first ? node_idx + 1        : node.RightChild();
+            int second  = left_first ? node.RightChild()   : node_idx + 1;
+            // a ray parallel to the split plane never crosses it. tsplit is nan if the origin lies on the plane,
+            // so only the child on the origin's side is visited
+            if(r.direction[axis] == 0 || tsplit > tmax || tsplit <= 0) node_idx = first;
+            else if(tsplit < tmin) node_idx = second;
+            else { // visit the near child first and come back for the far one
+                todo[todo_size++] = { second, tsplit, tmax };
+                node_idx = first, tmax = tsplit;
+            }
+            continue;
+        }
+        tlimit = intersect_leaf(node);
+        if(todo_size == 0) break;
+        const KDTodo& next = todo[--todo_size];
+        node_idx = next.node_idx, tmin = next.tmin, tmax = next.tmax;
+    }
+}
+
+bool KDTree::Intersect(const Ray& r, Hit* h) const
+{
+    bool did_hit = false;
+    KDMailbox mailbox;
+    TraversalCounter counter;
+    this->Traverse(r, h->t, &counter, [&](const KDFlatNode& leaf) {
+        if(this->IntersectLeaf(leaf, r, h, &mailbox, &counter)) did_hit = true;
+        return h->t; // stop as soon as the closest hit so far lies in front of the next node
+    });
+    return did_hit;
+}
+
+bool KDTree::IntersectAny(const Ray& r, double tmax) const
+{
+    bool occluded = false;
+    KDMailbox mailbox;
+    TraversalCounter counter;
+    this->Traverse(r, tmax, &counter, [&](const KDFlatNode& leaf) {
+        const int* prims = &this->indices[leaf.primitive_offset];
+        for(uint32_t i = 0; i < leaf.NumPrimitives(); ++i) {
+            if(mailbox.Visited(prims[i])) {
+                counter.mailbox_hits++;
+                continue;
+            }
+            counter.primitives_tested++;
+            if(this->primitives.Occludes(prims[i], r, tmax)) {
+                occluded = true;
+                return -M_INF;
+            }
+        }
+        return tmax;
+    });
+    return occluded;
+}
+
+// subtree that still has to be visited by the rays in mask, along with the segments of the rays overlapping it
+struct KDPacketTodo {
+    int node_idx;
+    unsigned mask;
+    double tmin[RAY_PACKET_SIZE], tmax[RAY_PACKET_SIZE];
+};
+
+// the rays of a coherent packet agree on the near child of every split, so they descend the tree together and each
+// leaf intersects its primitives with all rays whose segment overlaps it at once
+void KDTree::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
+    // rays with different direction signs disagree on the order of the children, so they are traced one by one
+    if(!p.Coherent(mask)) return Accelerator::IntersectPacket(p, hits, mask);
+
+    double tmin[RAY_PACKET_SIZE], tmax[RAY_PACKET_SIZE];
+    for(int k = 0; k < RAY_PACKET_SIZE; ++k) {
+        tmin[k] = 0.0, tmax[k] = -1.0;
+        if(!((mask >> k) & 1)) continue;
+        double t0, t1;
+        if(this->bbox.Intersect(p.rays[k], &t0, &t1) && t0 <= t1 && t1 > 0) tmin[k] = Max(t0, 0.0), tmax[k] = t1;
+        else mask &= ~(1u << k);
+    }
+    if(!mask) return;
+
+    RayPacketSoA rays(p, mask);
+    const Vec3& dir = p.rays[__builtin_ctz(mask)].direction;
+    bool dir_is_neg[3] = { dir.x < 0, dir.y < 0, dir.z < 0 };
+    KDPacketTodo todo[KD_MAX_DEPTH];
+    int todo_size = 0, node_idx = 0;
+    KDPacketMailbox mailbox;
+    TraversalCounter counter; // counts a node or primitive once per ray that visits it
+    while(true) {
+        const KDFlatNode& node = this->nodes[node_idx];
+        counter.nodes_visited += __builtin_popcount(mask);
+        if(!node.IsLeaf()) {
+            int axis = int(node.SplitAxis());
+            double pos = node.split;
+            double tsplit[RAY_PACKET_SIZE];
+            unsigned near_mask = 0, far_mask = 0;
+            for(int k = 0; k < RAY_PACKET_SIZE; ++k) {
+                tsplit[k] = (pos - rays.origin[axis][k])*rays.inv_dir[axis][k];
+                near_mask |= unsigned(tsplit[k] >= tmin[k]) << k;
+                far_mask |= unsigned(tsplit[k] <= tmax[k]) << k;
+            }
+            near_mask &= mask, far_mask &= mask;
+            int near_child = dir_is_neg[axis] ? node.RightChild() : node_idx + 1;
+            int far_child  = dir_is_neg[axis] ? node_idx + 1       : node.RightChild();
+            if(!near_mask) { // every ray crosses the plane before its segment starts
+                for(int k = 0; k < RAY_PACKET_SIZE; ++k) tmin[k] = Max(tmin[k], tsplit[k]);
+                node_idx = far_child, mask = far_mask;
+                continue;
+            }
+            if(far_mask) { // visit the near child first and come back for the far one
+                KDPacketTodo& next = todo[todo_size++];
+                next.node_idx = far_child, next.mask = far_mask;
+                for(int k = 0; k < RAY_PACKET_SIZE; ++k) next.tmin[k] = Max(tmin[k], tsplit[k]), next.tmax[k] = tmax[k];
+            }
+            for(int k = 0; k < RAY_PACKET_SIZE; ++k) tmax[k] = Min(tmax[k], tsplit[k]);
+            node_idx = near_child, mask = near_mask;
+            continue;
+        }
+        const int* prims = &this->indices[node.primitive_offset];
+        for(uint32_t i = 0; i < node.NumPrimitives(); ++i) {
+            unsigned untested = mailbox.Untested(prims[i], mask);
+            counter.mailbox_hits += __builtin_popcount(mask & ~untested);
+            counter.primitives_tested += __builtin_popcount(untested);
+            if(untested) this->primitives.IntersectPacket(prims[i], p, hits, untested);
+        }
+        // the next node only needs the rays whose closest hit so far does not lie in front of it
+        mask = 0;
+        while(!mask && todo_size > 0) {
+            const KDPacketTodo& next = todo[--todo_size];
+            for(unsigned m = next.mask; m; m &= m - 1) {
+                int k = __builtin_ctz(m);
+                if(hits[k].t >= next.tmin[k]) mask |= 1u << k;
+            }
+            node_idx = next.node_idx;
+            for(int k = 0; k < RAY_PACKET_SIZE; ++k) tmin[k] = next.tmin[k], tmax[k] = next.tmax[k];
+        }
+        if(!mask) break;
+    }
+}
+
+void KDTree::Save(BinaryWriter* writer) const
+{
+    writer->Write(this->bbox);
+    writer->WriteArray(this->nodes);
+    writer->WriteArray(this->indices);
+}
+
+std::unique_ptr<KDTree> KDTree::Load(const PrimitiveSet& primitives, BinaryReader* reader)
+{
+    std::unique_ptr<KDTree> tree(new KDTree());
+    tree->primitives = primitives;
+    if(!reader->Read(&tree->bbox) || !reader->ReadArray(&tree->nodes) || !reader->ReadArray(&tree->indices)) return nullptr;
+    for(int idx : tree->indices) {
+        if(idx < 0 || idx >= primitives.Size()) return nullptr;
+    }
+    // a corrupt file must not make the traversal read outside of the arrays or overflow its stack. the children of
+    // every interior node follow it, and each node but the root is the child of exactly one node
+    if(tree->nodes.empty()) return nullptr;
+    std::vector<int> depth(tree->nodes.size(), -1);
+    depth[0] = 0;
+    for(uint32_t i = 0; i < tree->nodes.size(); ++i) {
+        const KDFlatNode& node = tree->nodes[i];
+        if(depth[i] < 0) return nullptr;
+        if(node.IsLeaf()) {
+            if(uint64_t(node.primitive_offset) + node.NumPrimitives() > tree->indices.size()) return nullptr;
+            continue;
+        }
+        uint32_t right = node.RightChild();
+        if(depth[i] >= KD_MAX_DEPTH || right <= i + 1 || right >= tree->nodes.size() || depth[i + 1] >= 0 || depth[right] >= 0) return nullptr;
+        depth[i + 1] = depth[right] = depth[i] + 1;
+    }
+    return tree;
 }
@@ -25,6 +25,13 @@ void LoadingBar::Display(const char* end_msg)
     fflush(stdout);
 }
 
+void LoadingBar::Reset()
+{
+    std::lock_guard<std::mutex> guard(this->mtx);
+    this->cur_val = 0;
+    this->t0 = TimeNow();
+}
+
 void LoadingBar::Update()
 {
     std::lock_guard<std::mutex> guard(this->mtx);
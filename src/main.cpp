@@ -20,19 +20,26 @@ int main(int argc, char** argv)
     //Material* sphere_material = new Specular(HexColor(0x808080));
 
     Scene scene;
+    //scene.SetKDBuildParams({ KDBuildMethod::MEDIAN });
+    //scene.SetAccelerator(AcceleratorType::BVH);
     scene.Add(new Sphere({0,0,1}, 1,  sphere_material));
     //auto mesh = ReadSTL("dragon.stl", sphere_material);
     //auto mesh = ReadSTL("minified.stl", sphere_material);
+    //auto mesh = ReadSTLCached("dragon.stl", sphere_material, "cache"); // skips the import and build on later runs
+    //mesh->SetKDBuildParams({ KDBuildMethod::MEDIAN });
+    //mesh->SetAccelerator(AcceleratorType::BVH);
     //mesh->Rotate({0,0,1}, DEG2RAD(30));
     //mesh->MoveTo({0, 1, 0.5});
     //mesh->FitInsideUnitCube();
     //mesh->MoveTo({0,0,1});
     //scene.Add(mesh);
+    //scene.Add(new Instance(mesh, TranslationMatrix({2, 0, 0}))); // shares the geometry and tree of mesh
     scene.Add(new Sphere({0,0,-999}, 999, floor_material));;
     scene.Add(new Sphere({3,1,4}, 2, new DiffuseLight(ColorTemperature(5000)*7)));
     scene.Build();
 
     Renderer renderer(&scene, &cam, w, h, num_samples);
+    //renderer.SetIntegrator(IntegratorType::WAVEFRONT);
 
     double t1 = TimeNow();
     renderer.Render("test.jpg", 1000);
@@ -40,6 +40,16 @@ Vec3 Mat4::MultiplyPosition(const Vec3& p) const
     return v;
 }
 
+Vec3 Mat4::MultiplyVector(const Vec3& d) const
+{
+    Vec3 v = {
+        a00*d.x + a01*d.y + a02*d.z,
+        a10*d.x + a11*d.y + a12*d.z,
+        a20*d.x + a21*d.y + a22*d.z
+    };
+    return v;
+}
+
 Vec3 Mat4::MultiplyDirection(const Vec3& d) const
 {
     Vec3 v = {
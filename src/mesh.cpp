@@ -1,13 +1,17 @@
 #include "mesh.h"
 
+#include "accelerator.h"
 #include "kdtree.h"
 #include "vec3.h"
 #include "mat4.h"
 #include "hit.h"
 #include "material.h"
 #include "surface.h"
+#include "cache.h"
+#include "thread_pool.h"
 
 #include <unordered_map>
+#include <algorithm>
 #include <assert.h>
 
 #ifdef EMBREE
@@ -29,7 +33,8 @@ Mesh::Mesh(const std::vector<Vec3>& positions, const std::vector<Vec3>& normals,
 }
 
 Mesh::Mesh(const std::vector<Vec3>& positions, const std::vector<Vec3>& normals, const std::vector<Vec3>& texcoords, Material* material)
-    : num_triangles(positions.size() / 3)
+    : accel_type(AcceleratorType::KDTREE), accel_chosen(false), needs_refit(false), num_triangles(positions.size() / 3), material(material),
+      blocks(this)
 {
     assert(positions.size() > 0);
     if(normals.size() > 0) assert(normals.size() == positions.size());
@@ -52,14 +57,29 @@ Mesh::Mesh(const std::vector<Vec3>& positions, const std::vector<Vec3>& normals,
         this->indices.push_back(map[positions[3*i + 1]]);
         this->indices.push_back(map[positions[3*i + 2]]);
     }
-    for(int i = 0; i < this->num_triangles; ++i) this->triangles.emplace_back(this, i, material);
     this->RepairNormals();
 }
 
+Mesh::Mesh(const std::vector<int>& indices, const std::vector<Vec3>& positions, const std::vector<Vec3>& normals, const std::vector<Vec3>& texcoords, Material* material)
+    : accel_type(AcceleratorType::KDTREE), accel_chosen(false), needs_refit(false), num_triangles(indices.size() / 3),
+      indices(indices), positions(positions.begin(), positions.end()), normals(normals.begin(), normals.end()),
+      texcoords(texcoords.begin(), texcoords.end()), material(material), blocks(this)
+{
+    assert(positions.size() > 0);
+    this->RepairNormals();
+}
+
+#ifdef EMBREE
+Mesh::~Mesh()
+{
+    if(this->embree_scene) rtcReleaseScene(this->embree_scene);
+}
+#endif
+
 void Mesh::Dirtify()
 {
-    this->bbox.release();
-    this->tree.release();
+    this->bbox.reset();
+    this->needs_refit = true; // the tree is refit or rebuilt on the next call to Build()
 }
 
 bool Mesh::Intersect(const Ray& r, Hit* h) const
@@ -84,7 +104,7 @@ bool Mesh::Intersect(const Ray& r, Hit* h) const
     if(rtc_rh.hit.primID == RTC_INVALID_GEOMETRY_ID) return false;
 
     double t = rtc_rh.ray.tfar;
-    h->RecordHit(t, &this->triangles[rtc_rh.hit.primID]);
+    h->RecordHit(t, this, rtc_rh.hit.primID, rtc_rh.hit.u, rtc_rh.hit.v);
 
     return true;
 #else
@@ -92,16 +112,70 @@ bool Mesh::Intersect(const Ray& r, Hit* h) const
 #endif
 }
 
-void Mesh::Build()
+bool Mesh::Occludes(const Ray& r, double tmax) const
 {
+#ifdef EMBREE
+    RTCIntersectContext context;
+    rtcInitIntersectContext(&context);
+
+    Vec3 o = r.origin, d = r.direction;
+
+    RTCRay rtc_ray;
+    rtc_ray.org_x = o.x; rtc_ray.org_y = o.y; rtc_ray.org_z = o.z;
+    rtc_ray.dir_x = d.x; rtc_ray.dir_y = d.y; rtc_ray.dir_z = d.z;
+    rtc_ray.tnear = M_EPS; rtc_ray.tfar = tmax;
+    rtc_ray.mask = -1;
+    rtc_ray.flags = rtc_ray.time = rtc_ray.id = 0;
+
+    rtcOccluded1(this->embree_scene, &context, &rtc_ray);
+
+    return rtc_ray.tfar < 0; // embree sets tfar to -inf when the ray is occluded
+#else
+    return this->tree->IntersectAny(r, tmax);
+#endif
+}
+
+void Mesh::BuildBBox()
+{
+    std::lock_guard<std::mutex> lock(this->bbox_mutex);
     if(!this->bbox) {
         Vec3 min = this->positions[0], max = this->positions[0];
-        for(const Vec3& pos : this->positions) {
+        for(const Vec3 pos : this->positions) {
             min = Min(min, pos), max = Max(max, pos);
         }
         this->bbox = std::make_unique<BBox>(min, max);
     }
+}
+
+void Mesh::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
 #ifdef EMBREE
+    Surface::IntersectPacket(p, hits, mask);
+#else
+    this->tree->IntersectPacket(p, hits, mask);
+#endif
+}
+
+void Mesh::Build()
+{
+    this->BuildBBox();
+    // the thread building the mesh can get here again while it helps out with other tasks, e.g. the build of another
+    // instance of this mesh. the outer call finishes the build then. any other thread helps out until it is done
+    std::thread::id self = std::this_thread::get_id(), none;
+    if(this->builder.load() == self) return;
+    while(!this->builder.compare_exchange_weak(none, self)) {
+        none = std::thread::id();
+        if(!ThreadPool::Global()->RunPendingTask()) std::this_thread::yield();
+    }
+    struct BuildDone {
+        std::atomic<std::thread::id>& builder;
+        ~BuildDone() { this->builder.store(std::thread::id()); }
+    } done = { this->builder };
+#ifdef EMBREE
+    if(this->embree_scene && !this->needs_refit) return;
+    // scenes of the Scene that instance the old embree scene keep their own reference to it
+    if(this->embree_scene) rtcReleaseScene(this->embree_scene);
+    this->needs_refit = false;
     this->embree_scene = rtcNewScene(device);
     RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
 
@@ -116,11 +190,10 @@ void Mesh::Build()
 
     EmbreeTriangle* tbuf = (EmbreeTriangle*)rtcSetNewGeometryBuffer(
         geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3,
-        sizeof(EmbreeTriangle), this->triangles.size()
+        sizeof(EmbreeTriangle), this->num_triangles
     );
-    for(int i = 0; i < this->triangles.size(); ++i) {
-        const Triangle& t = this->triangles[i];
-        tbuf[i] = { t.v[0], t.v[1], t.v[2] };
+    for(int i = 0; i < this->num_triangles; ++i) {
+        tbuf[i] = { this->indices[3*i + 0], this->indices[3*i + 1], this->indices[3*i + 2] };
     }
 
     rtcCommitGeometry(geom);
@@ -128,40 +201,235 @@ void Mesh::Build()
     rtcReleaseGeometry(geom);
     rtcCommitScene(this->embree_scene);
 #else
-    if(!this->tree) {
-        std::vector<Surface*> surfaces;
-        surfaces.reserve(this->num_triangles);
-        for(Triangle& t : this->triangles) {
-            surfaces.push_back(&t);
+    if(this->tree && this->needs_refit) {
+        this->blocks.Update();
+        if(!this->tree->Refit()) {
+            // k-d trees cannot be refit, geometry that moves is rebuilt as a bvh that later frames can refit instead
+            if(!this->accel_chosen) this->accel_type = AcceleratorType::BVH;
+            this->tree.reset();
         }
-        this->tree = std::make_unique<KDTree>(surfaces);
+    }
+    this->needs_refit = false;
+    if(!this->tree) {
+        this->blocks.Assign(this->GroupTriangles());
+        this->tree = BuildAccelerator(this->accel_type, &this->blocks, this->kd_params);
     }
 #endif
 }
 
+// interleaves the lowest 10 bits of x, y and z
+static inline uint32_t MortonCode(uint32_t x, uint32_t y, uint32_t z)
+{
+    auto spread = [](uint32_t v) {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+}
+
+// splits a morton ordered range at the highest bit in which its codes differ, like the nodes of a linear bvh,
+// until it fits into a block. the triangles of each range lie in the same cell of the morton grid
+static void CollectBlocks(const std::vector<std::pair<uint32_t, int>>& coded, int begin, int end, std::vector<int>* block_faces)
+{
+    if(end - begin > TRIANGLE_BLOCK_SIZE) {
+        uint32_t first = coded[begin].first, last = coded[end - 1].first;
+        int mid = (begin + end) / 2; // triangles with equal codes are split in the middle
+        if(first != last) {
+            uint32_t bit = 1u << (31 - __builtin_clz(first ^ last));
+            mid = std::partition_point(coded.begin() + begin, coded.begin() + end, [bit](const std::pair<uint32_t, int>& c) {
+                return !(c.first & bit);
+            }) - coded.begin();
+        }
+        CollectBlocks(coded, begin, mid, block_faces);
+        CollectBlocks(coded, mid, end, block_faces);
+        return;
+    }
+    for(int j = 0; j < TRIANGLE_BLOCK_SIZE; ++j) {
+        block_faces->push_back(begin + j < end ? coded[begin + j].second : -1);
+    }
+}
+
+std::vector<int> Mesh::GroupTriangles()
+{
+    if(this->num_triangles == 0) return {};
+    std::vector<Vec3> centroids(this->num_triangles);
+    for(int i = 0; i < this->num_triangles; ++i) centroids[i] = this->TriangleBBox(i).Anchor(Vec3(0.5));
+    Vec3 min = centroids[0], max = centroids[0];
+    for(const Vec3& c : centroids) min = Min(min, c), max = Max(max, c);
+    // sorting the centroids along a morton curve is much cheaper than building a hierarchy over the triangles
+    double scale = 1023.0 / Max((max - min).MaxComponent(), 1e-30);
+    std::vector<std::pair<uint32_t, int>> coded(this->num_triangles);
+    for(int i = 0; i < this->num_triangles; ++i) {
+        Vec3 p = (centroids[i] - min)*scale;
+        coded[i] = { MortonCode(uint32_t(p.x), uint32_t(p.y), uint32_t(p.z)), i };
+    }
+    std::sort(coded.begin(), coded.end());
+    std::vector<int> block_faces;
+    block_faces.reserve(TRIANGLE_BLOCK_SIZE*(this->num_triangles / TRIANGLE_BLOCK_SIZE + 1));
+    CollectBlocks(coded, 0, this->num_triangles, &block_faces);
+    return block_faces;
+}
+
+BBox Mesh::TriangleBBox(int prim) const
+{
+    const int* v = &this->indices[3*prim];
+    const Vec3& v0 = this->positions[v[0]];
+    const Vec3& v1 = this->positions[v[1]];
+    const Vec3& v2 = this->positions[v[2]];
+    return { Min(v0, Min(v1, v2)), Max(v0, Max(v1, v2)) };
+}
+
+Vec3 Mesh::TriangleNormal(int prim) const
+{
+    const int* v = &this->indices[3*prim];
+    const Vec3& v0 = this->positions[v[0]];
+    const Vec3& v1 = this->positions[v[1]];
+    const Vec3& v2 = this->positions[v[2]];
+    return Normalized(Cross(v1 - v0, v2 - v0));
+}
+
+bool Mesh::IntersectTriangle(int prim, const Ray& r, Hit* h) const
+{
+    const int* v = &this->indices[3*prim];
+    const Vec3& v0 = this->positions[v[0]];
+    const Vec3& v1 = this->positions[v[1]];
+    const Vec3& v2 = this->positions[v[2]];
+    Vec3 e1 = v1 - v0, e2 = v2 - v0;
+    Vec3 p = Cross(r.direction, e2);
+    double det = Dot(e1, p);
+    if(det > -M_EPS && det < M_EPS) return false;
+    double inv_det = 1.0 / det;
+    Vec3 t = r.origin - v0;
+    double u = Dot(t, p)*inv_det;
+    if(u < 0 || u > 1) return false;
+    Vec3 q = Cross(t, e1);
+    double w = Dot(r.direction, q)*inv_det;
+    if(w < 0 || u + w > 1) return false;
+    double d = Dot(e2, q)*inv_det;
+    if(d < M_EPS || d > h->t) return false;
+    h->RecordHit(d, this, prim, u, w);
+    return true;
+}
+
+void Mesh::FillRecord(const Hit& h, const Vec3& p, HitRecord* hr) const
+{
+    const int* v = &this->indices[3*h.prim];
+    double b0 = 1.0 - h.b1 - h.b2;
+    const Vec3& n0 = this->normals[v[0]];
+    const Vec3& n1 = this->normals[v[1]];
+    const Vec3& n2 = this->normals[v[2]];
+    hr->normal = Normalized(b0*n0 + h.b1*n1 + h.b2*n2);
+    hr->material = this->material;
+    hr->u = hr->v = 0.0;
+    if(!this->texcoords.empty() && this->material->NeedsUV()) {
+        const Vec3& t0 = this->texcoords[v[0]];
+        const Vec3& t1 = this->texcoords[v[1]];
+        const Vec3& t2 = this->texcoords[v[2]];
+        Vec3 uv = b0*t0 + h.b1*t1 + h.b2*t2;
+        hr->u = uv.x, hr->v = uv.y;
+    }
+}
+
+void Mesh::Save(BinaryWriter* writer)
+{
+    this->Build();
+    writer->WriteArray(this->indices);
+    writer->WriteArray(this->positions);
+    writer->WriteArray(this->normals);
+    writer->WriteArray(this->texcoords);
+    writer->Write(this->accel_type);
+    writer->Write(this->kd_params);
+    writer->Write(uint8_t(this->tree != nullptr)); // embree builds are not cached
+    if(this->tree) {
+        std::vector<int> block_faces;
+        block_faces.reserve(TRIANGLE_BLOCK_SIZE*this->blocks.Size());
+        for(int i = 0; i < this->blocks.Size(); ++i) {
+            const int* faces = this->blocks.Faces(i);
+            block_faces.insert(block_faces.end(), faces, faces + TRIANGLE_BLOCK_SIZE);
+        }
+        writer->WriteArray(block_faces);
+        this->tree->Save(writer);
+    }
+}
+
+std::shared_ptr<Mesh> Mesh::Load(BinaryReader* reader, Material* material)
+{
+    std::vector<int> indices;
+    std::vector<GeometryVec3> positions, normals, texcoords;
+    AcceleratorType accel_type;
+    KDBuildParams kd_params;
+    uint8_t has_tree;
+    if(!reader->ReadArray(&indices) || !reader->ReadArray(&positions) || !reader->ReadArray(&normals) || !reader->ReadArray(&texcoords)) return nullptr;
+    if(!reader->Read(&accel_type) || !reader->Read(&kd_params) || !reader->Read(&has_tree)) return nullptr;
+    if(int(accel_type) < int(AcceleratorType::KDTREE) || int(accel_type) > int(AcceleratorType::BVH4)) return nullptr;
+    if(int(kd_params.method) < int(KDBuildMethod::MEDIAN) || int(kd_params.method) > int(KDBuildMethod::SAH) || kd_params.num_bins < 1) return nullptr;
+    if(positions.empty() || indices.size() % 3 != 0 || (!normals.empty() && normals.size() != positions.size()) ||
+       (!texcoords.empty() && texcoords.size() != positions.size())) return nullptr;
+    for(int idx : indices) {
+        if(idx < 0 || idx >= int(positions.size())) return nullptr;
+    }
+    auto mesh = std::make_shared<Mesh>(indices, std::vector<Vec3>(positions.begin(), positions.end()),
+        std::vector<Vec3>(normals.begin(), normals.end()), std::vector<Vec3>(texcoords.begin(), texcoords.end()), material);
+    mesh->accel_type = accel_type, mesh->accel_chosen = true, mesh->kd_params = kd_params;
+    if(has_tree) {
+        std::vector<int> block_faces;
+        if(!reader->ReadArray(&block_faces) || block_faces.size() % TRIANGLE_BLOCK_SIZE != 0) return nullptr;
+        for(unsigned i = 0; i < block_faces.size(); i += TRIANGLE_BLOCK_SIZE) {
+            if(block_faces[i] < 0 || block_faces[i] >= mesh->num_triangles) return nullptr; // every block holds at least one triangle
+            for(int j = 1; j < TRIANGLE_BLOCK_SIZE; ++j) {
+                // unused lanes are -1 and come after the triangles of the block
+                int face = block_faces[i + j];
+                if(face < -1 || face >= mesh->num_triangles || (face >= 0 && block_faces[i + j - 1] < 0)) return nullptr;
+            }
+        }
+        mesh->blocks.Assign(block_faces);
+        mesh->tree = LoadAccelerator(accel_type, &mesh->blocks, reader);
+        if(!mesh->tree) return nullptr;
+    }
+    return mesh;
+}
+
+void Mesh::SetAccelerator(AcceleratorType type)
+{
+    this->accel_type = type;
+    this->accel_chosen = true;
+    this->tree.reset(); // rebuilt with the new accelerator on the next call to Build()
+}
+
+void Mesh::SetKDBuildParams(const KDBuildParams& params)
+{
+    this->kd_params = params;
+    this->tree.reset(); // rebuilt with the new parameters on the next call to Build()
+}
+
 BBox Mesh::GetBBox()
 {
-    if(!this->bbox) this->Build();
+    this->BuildBBox();
     return *this->bbox;
 }
 
 void Mesh::RepairNormals()
 {
     if(!this->normals.empty()) return;
-    this->normals.resize(this->positions.size(), Vec3(0));
-    for(const Triangle& t : this->triangles) {
-        Vec3 n = t.Normal();
-        this->normals[t.v[0]] += n;
-        this->normals[t.v[1]] += n;
-        this->normals[t.v[2]] += n;
+    std::vector<Vec3> normals(this->positions.size(), Vec3(0)); // accumulated in double precision
+    for(int i = 0; i < this->num_triangles; ++i) {
+        Vec3 n = this->TriangleNormal(i);
+        normals[this->indices[3*i + 0]] += n;
+        normals[this->indices[3*i + 1]] += n;
+        normals[this->indices[3*i + 2]] += n;
     }
-    for(Vec3& n : this->normals) n = Normalized(n);
+    this->normals.reserve(normals.size());
+    for(const Vec3& n : normals) this->normals.push_back(Normalized(n));
 }
 
 void Mesh::Transform(const Mat4& m)
 {
-    for(Vec3& p : this->positions)  p = m.MultiplyPosition(p);
-    for(Vec3& n : this->normals)    n = m.MultiplyDirection(n);
+    for(GeometryVec3& p : this->positions)  p = m.MultiplyPosition(p);
+    for(GeometryVec3& n : this->normals)    n = m.MultiplyDirection(n);
     this->Dirtify();
 }
 
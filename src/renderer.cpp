@@ -1,11 +1,15 @@
 #include "renderer.h"
 
 #include "ray.h"
+#include "hit.h"
 #include "camera.h"
 #include "scene.h"
 #include "vec3.h"
 #include "sampler.h"
+#include "wavefront.h"
 #include "loading_bar.h"
+#include "tile_queue.h"
+#include "thread_pool.h"
 
 #ifdef EMBREE
 #include <pmmintrin.h>
@@ -13,17 +17,44 @@
 #endif
 
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <string>
 #include <thread>
 
+// memory a render thread reuses for every tile and iteration
+struct RenderThreadState {
+    std::unique_ptr<WavefrontIntegrator> wavefront;
+    std::vector<Ray> rays;
+    std::vector<Vec3> cols;
+    // sums of the samples of the current tile in row-major order, added to the image once the tile is done so that
+    // the threads do not write to the shared image for every sample
+    std::vector<Rgb> tile_sums;
+};
+
 Renderer::Renderer(Scene* scene, Camera* cam, int w, int h, int spp)
-    : scene(scene), cam(cam), spp(spp), global_ray_count(0)
+    : scene(scene), cam(cam), spp(spp), pin_threads(false), integrator(IntegratorType::PATH), heatmap(false)
 {
     this->img = Image(w,h);
-    this->num_threads = std::thread::hardware_concurrency();
+    this->num_threads = Max(1, int(std::thread::hardware_concurrency()));
     this->scene->Build();
 }
 
+Renderer::~Renderer() = default; // here, where RenderThreadState is complete
+
+void Renderer::SetNumThreads(int num_threads)
+{
+    this->num_threads = Max(1, num_threads);
+    this->pool.reset(); // recreated with the new number of threads on the next call to Render()
+}
+
+void Renderer::SetThreadAffinity(bool pin_threads)
+{
+    this->pin_threads = pin_threads;
+    this->pool.reset();
+}
+
 static inline std::string GetFileExtension(const std::string& filename)
 {
     if(filename.find_last_of(".") != std::string::npos)
@@ -31,7 +62,7 @@ static inline std::string GetFileExtension(const std::string& filename)
     return "";
 }
 
-void Renderer::SaveImage(std::string filename, int iter)
+void Renderer::SaveImage(const Image& img, std::string filename, int iter)
 {
     if(filename.find("%") != std::string::npos ) {
         char formatted_filename[256];
@@ -39,32 +70,162 @@ void Renderer::SaveImage(std::string filename, int iter)
         filename = formatted_filename;
     }
     std::string extension = GetFileExtension(filename);
-    if(extension == "png") this->img.SavePNG(filename.c_str());
-    else if(extension == "jpg" || extension == "jpeg") this->img.SaveJPG(filename.c_str());
-    else if(extension == "ppm") this->img.SavePPM(filename.c_str());
+    if(extension == "png") img.SavePNG(filename.c_str());
+    else if(extension == "jpg" || extension == "jpeg") img.SaveJPG(filename.c_str());
+    else if(extension == "ppm") img.SavePPM(filename.c_str());
+    else if(extension == "sums") img.SaveSums(filename.c_str()); // raw sums, see Image::AddSums
     else {
-        printf("Unsupported filetype '%s', must either be png, jpg or ppm. Exiting program...\n", extension.c_str());
+        printf("Unsupported filetype '%s', must either be png, jpg, ppm or sums. Exiting program...\n", extension.c_str());
         exit(0);
     }
 }
 
-void Renderer::RenderFrame(int thread_id, LoadingBar* lb)
+// dark blue for no work through cyan, green and yellow to red for the most work
+static Rgb HeatmapColor(double t)
+{
+    static const Rgb colors[] = { {0.0, 0.0, 0.5}, {0.0, 0.5, 1.0}, {0.0, 0.8, 0.3}, {1.0, 0.9, 0.0}, {1.0, 0.0, 0.0} };
+    constexpr int n = sizeof(colors) / sizeof(colors[0]);
+    t = Clamp(t, 0.0, 1.0)*(n - 1);
+    int i = Min(int(t), n - 2);
+    Rgb col = colors[i] + (colors[i+1] - colors[i])*(t - i);
+    return Pow(col, 2.2); // undo the gamma correction of the image output
+}
+
+// false colour image of the per pixel costs, scaled so that only the most expensive percent of the pixels are red.
+// the cost mapped to red is returned in max_cost
+static Image CostImage(const std::vector<double>& cost, int w, int h, double* max_cost)
+{
+    std::vector<double> sorted = cost;
+    auto nth = sorted.begin() + sorted.size()*99/100;
+    std::nth_element(sorted.begin(), nth, sorted.end());
+    *max_cost = *nth;
+    double scale = *max_cost > 0 ? 1.0 / *max_cost : 0.0;
+    Image img(w, h);
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) img.AddPixel(x, y, HeatmapColor(cost[y*w + x]*scale));
+    }
+    return img;
+}
+
+static inline std::string AddFileSuffix(const std::string& filename, const std::string& suffix)
+{
+    size_t dot = filename.find_last_of(".");
+    if(dot == std::string::npos) return filename + suffix;
+    return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+void Renderer::SaveHeatmaps(const std::string& filename, int iter)
+{
+    int w = this->img.Width(), h = this->img.Height();
+    std::vector<double> nodes(w*h), prims(w*h), nanoseconds(w*h);
+    for(int i = 0; i < w*h; ++i) {
+        const PixelCost& c = this->costs[i];
+        double n = Max(c.num_samples, 1);
+        nodes[i] = c.nodes_visited / n, prims[i] = c.primitives_tested / n, nanoseconds[i] = c.nanoseconds / n;
+    }
+    double max_nodes, max_prims, max_nanoseconds;
+    this->SaveImage(CostImage(nodes, w, h, &max_nodes), AddFileSuffix(filename, "_nodes"), iter);
+    this->SaveImage(CostImage(prims, w, h, &max_prims), AddFileSuffix(filename, "_prims"), iter);
+    this->SaveImage(CostImage(nanoseconds, w, h, &max_nanoseconds), AddFileSuffix(filename, "_time"), iter);
+    printf("heatmaps: red is %.1f nodes, %.1f primitives, %.0f ns per sample\n", max_nodes, max_prims, max_nanoseconds);
+}
+
+void Renderer::RenderFrame(int thread_id, TileQueue* queue, LoadingBar* lb)
+{
+    ThreadRayStats() = RayStats();
+    RenderThreadState* state = this->thread_states[this->pool->WorkerIndex()].get();
+    bool wavefront = !this->heatmap && this->integrator == IntegratorType::WAVEFRONT;
+    if(wavefront && !state->wavefront) state->wavefront = std::make_unique<WavefrontIntegrator>(this->scene);
+    Tile tile;
+    while(queue->Next(thread_id, &tile)) {
+        int tile_w = tile.x1 - tile.x0, tile_h = tile.y1 - tile.y0;
+        state->tile_sums.assign(tile_w*tile_h, Rgb(0.0));
+        if(this->heatmap) this->RenderTileCosts(tile, state);
+        else if(wavefront) this->RenderTileWavefront(tile, state);
+        else this->RenderTile(tile, state);
+        this->img.AddBlock(tile.x0, tile.y0, tile_w, tile_h, state->tile_sums.data(), this->spp);
+        if(lb != nullptr) lb->Update();
+    }
+    this->AddThreadStats();
+}
+
+void Renderer::RenderTile(const Tile& tile, RenderThreadState* state)
 {
-    Scene::ResetRayCount();
     int w = this->img.Width(), h = this->img.Height();
-    for(int y = thread_id; y < h; y += this->num_threads) {
-        for(int x = 0; x < w; ++x) {
+    int tile_w = tile.x1 - tile.x0;
+    for(int y = tile.y0; y < tile.y1; ++y) {
+        // primary rays of neighbouring pixels are coherent, so they are traced as packets
+        for(int x0 = tile.x0; x0 < tile.x1; x0 += RAY_PACKET_SIZE) {
+            RayPacket packet;
+            packet.size = Min(RAY_PACKET_SIZE, tile.x1 - x0);
+            for(int s = 0; s < spp; ++s) {
+                for(int i = 0; i < packet.size; ++i) {
+                    double u = (x0 + i + RandomUniform()) / (double)w;
+                    double v = (y + RandomUniform()) / (double)h;
+                    packet.rays[i] = this->cam->CastRay(u, 1.0-v);
+                }
+                Hit hits[RAY_PACKET_SIZE];
+                this->scene->IntersectPacket(packet, hits, RayType::CAMERA);
+                Rgb* sums = &state->tile_sums[(y - tile.y0)*tile_w + x0 - tile.x0];
+                for(int i = 0; i < packet.size; ++i) sums[i] += Sample(this->scene, packet.rays[i], hits[i]);
+            }
+        }
+    }
+}
+
+void Renderer::RenderTileWavefront(const Tile& tile, RenderThreadState* state)
+{
+    int w = this->img.Width(), h = this->img.Height();
+    int tile_w = tile.x1 - tile.x0, num_pixels = tile_w*(tile.y1 - tile.y0);
+    // all samples of the tile form one batch, the samples of a pixel are next to each other so that they share packets
+    std::vector<Ray>& rays = state->rays;
+    std::vector<Vec3>& cols = state->cols;
+    rays.resize(num_pixels*this->spp);
+    for(int i = 0; i < num_pixels; ++i) {
+        int x = tile.x0 + i % tile_w, y = tile.y0 + i / tile_w;
+        for(int s = 0; s < spp; ++s) {
+            double u = (x + RandomUniform()) / (double)w;
+            double v = (y + RandomUniform()) / (double)h;
+            rays[i*this->spp + s] = this->cam->CastRay(u, 1.0-v);
+        }
+    }
+    state->wavefront->Trace(rays, &cols);
+    for(int i = 0; i < num_pixels; ++i) {
+        for(int s = 0; s < spp; ++s) state->tile_sums[i] += cols[i*this->spp + s];
+    }
+}
+
+void Renderer::RenderTileCosts(const Tile& tile, RenderThreadState* state)
+{
+    using namespace std::chrono;
+    const RayStats& stats = ThreadRayStats();
+    int w = this->img.Width(), h = this->img.Height();
+    int tile_w = tile.x1 - tile.x0;
+    for(int y = tile.y0; y < tile.y1; ++y) {
+        // no packets, so the traversal counters of the thread only count the work of this pixel
+        for(int x = tile.x0; x < tile.x1; ++x) {
+            uint64_t nodes = stats.nodes_visited, prims = stats.primitives_tested;
+            auto t1 = steady_clock::now();
+            Rgb& sum = state->tile_sums[(y - tile.y0)*tile_w + x - tile.x0];
             for(int s = 0; s < spp; ++s) {
                 double u = (x + RandomUniform()) / (double)w;
                 double v = (y + RandomUniform()) / (double)h;
-                Ray ray = this->cam->CastRay(u, 1.0-v);
-                Rgb col = Sample(this->scene, ray);
-                this->img.AddPixel(x, y, col);
+                sum += Sample(this->scene, this->cam->CastRay(u, 1.0-v));
             }
+            auto t2 = steady_clock::now();
+            PixelCost& cost = this->costs[y*w + x];
+            cost.nodes_visited += stats.nodes_visited - nodes;
+            cost.primitives_tested += stats.primitives_tested - prims;
+            cost.nanoseconds += duration_cast<nanoseconds>(t2 - t1).count();
+            cost.num_samples += spp;
         }
-        if(lb != nullptr) lb->Update();
     }
-    this->global_ray_count += Scene::RayCount();
+}
+
+void Renderer::AddThreadStats()
+{
+    std::lock_guard<std::mutex> lock(this->stats_mutex);
+    this->frame_stats += ThreadRayStats();
 }
 
 void Renderer::Render(std::string filename, int num_iterations)
@@ -74,23 +235,46 @@ void Renderer::Render(std::string filename, int num_iterations)
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
     _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 #endif
+    FILE* stats_file = nullptr;
+    if(!this->stats_filename.empty() && !(stats_file = fopen(this->stats_filename.c_str(), "w"))) {
+        fprintf(stderr, "Cannot open statistics file \"%s\"\n", this->stats_filename.c_str());
+    }
+    if(this->heatmap) this->costs.resize(this->img.Width()*this->img.Height());
+    if(!this->pool) {
+        // the thread calling Render renders as well while it waits for the others
+        this->pool = std::make_unique<ThreadPool>(this->num_threads - 1, this->pin_threads);
+        this->thread_states.clear();
+        for(int i = 0; i <= this->pool->NumThreads(); ++i) this->thread_states.push_back(std::make_unique<RenderThreadState>());
+    }
+    TileQueue queue(MortonOrderedTiles(this->img.Width(), this->img.Height()), this->num_threads);
+    LoadingBar lb(queue.NumTiles());
     for(int iter = 1; iter <= num_iterations; ++iter) {
         printf("Iteration %d\n", iter);
-        LoadingBar lb(this->img.Height());
-        this->global_ray_count = 0;
+        queue.Reset();
+        lb.Reset();
+        this->frame_stats = RayStats();
 
         double t1 = TimeNow();
-        std::vector<std::thread> threads;
+        TaskGroup group(this->pool.get());
         for(int tid = 0; tid < this->num_threads; ++tid) {
-            threads.emplace_back(&Renderer::RenderFrame, this, tid, &lb);
+            group.Run([this, tid, &queue, &lb]() { this->RenderFrame(tid, &queue, &lb); });
         }
-        for(auto& t : threads) t.join();
+        group.Wait();
         double t2 = TimeNow();
 
         char end_msg[64];
-        sprintf(end_msg, "[%3.2f fps, %3.2f Mray/s]", 1./(t2-t1), double(this->global_ray_count.load())/(1e6*(t2-t1)));
+        sprintf(end_msg, "[%3.2f fps, %3.2f Mray/s]", 1./(t2-t1), double(this->frame_stats.TotalRays())/(1e6*(t2-t1)));
         lb.Done(end_msg);
+        this->frame_stats.Print();
+        if(stats_file) {
+            fprintf(stats_file, "{\"iteration\": %d, \"seconds\": %f, \"stats\": ", iter, t2-t1);
+            this->frame_stats.WriteJSON(stats_file);
+            fprintf(stats_file, "}\n");
+            fflush(stats_file); // renders may run until they are killed
+        }
 
-        this->SaveImage(filename, iter);
+        this->SaveImage(this->img, filename, iter);
+        if(this->heatmap) this->SaveHeatmaps(filename, iter);
     }
+    if(stats_file) fclose(stats_file);
 }
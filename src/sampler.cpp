@@ -21,91 +21,112 @@ Vec3 SampleBackground(Scene* scene, const Ray& ray)
     return scene->BackgroundColor();
 }
 
-Vec3 SampleDirectLighting(Scene* scene, const Surface* light, const ONB& onb, const HitRecord& hr, const Vec3& wo)
+// light sample at the shading point, without the visibility of the light
+static bool SampleDirectLighting(const Surface* light, const ONB& onb, const HitRecord& hr, const Vec3& wo, ShadowRay* shadow_ray)
 {
     Ray light_ray = light->RandomRay(hr.position);
     Hit hit;
-    if(scene->Intersect(light_ray, &hit)) {
-        HitRecord lhr = hit.GetRecord(light_ray);
-        Vec3 li = lhr.material->Emitted(lhr);
-        if(li.MaxComponent() > 0 && Dot(lhr.normal, light_ray.direction) < 0) {
-            double light_pdf = light->Pdf(light_ray);
-            Vec3 lwi = onb.WorldToLocal(light_ray.direction);
-            return hr.material->Eval(wo, lwi, hr)*li*fabs(lwi.z) / light_pdf;
-        }
-    }
-    return Vec3(0.0);
+    if(!light->Intersect(light_ray, &hit)) return false;
+    HitRecord lhr = hit.GetRecord(light_ray);
+    Vec3 li = lhr.material->Emitted(lhr);
+    if(li.MaxComponent() <= 0 || Dot(lhr.normal, light_ray.direction) >= 0) return false;
+    double light_pdf = light->Pdf(light_ray);
+    Vec3 lwi = onb.WorldToLocal(light_ray.direction);
+    // only visibility matters for the shadow ray, the light itself lies at the end of the segment
+    shadow_ray->ray = light_ray;
+    shadow_ray->tmax = hit.t*(1.0 - M_EPS);
+    shadow_ray->contribution = hr.material->Eval(wo, lwi, hr)*li*fabs(lwi.z) / light_pdf;
+    return true;
 }
 
-Vec3 SampleOneLight(Scene* scene, const ONB& onb, const HitRecord& hr, const Vec3& wo)
+bool SampleOneLight(Scene* scene, const ONB& onb, const HitRecord& hr, const Vec3& wo, ShadowRay* shadow_ray)
 {
     const auto& lights = scene->Lights();
     int num_lights = lights.size();
-    if(num_lights == 0) return Vec3(0.0); // return black if there are no lights
+    if(num_lights == 0) return false; // black if there are no lights
     int idx = RandomUniform(0, num_lights-1);
     const auto& light = lights[idx];
-    return num_lights*SampleDirectLighting(scene, light, onb, hr, wo);
+    if(!SampleDirectLighting(light, onb, hr, wo, shadow_ray)) return false;
+    shadow_ray->contribution *= num_lights;
+    return true;
 }
 
-Vec3 Sample(Scene* scene, const Ray& ray, int min_bounces, int max_bounces)
+bool ShadeHit(Scene* scene, PathState* path, const HitRecord* hr, ShadowRay* shadow_ray, int min_bounces)
 {
-    Vec3 col(0.0), throughput(1.0);
-    bool is_specular = true;
-    Ray cur_ray = ray;
-    for(int num_bounces = 0; num_bounces < max_bounces; ++num_bounces) {
-        Hit hit;
-        if(!scene->Intersect(cur_ray, &hit)) {
-            col += throughput*SampleBackground(scene, cur_ray);
-            break;
-        }
-        HitRecord hr = hit.GetRecord(cur_ray);
+    ThreadRayStats().shading_calls++;
+    shadow_ray->contribution = Vec3(0.0);
+    if(hr == nullptr) {
+        path->col += path->throughput*SampleBackground(scene, path->ray);
+        return false;
+    }
 
-        Vec3 emitted = hr.material->Emitted(hr);
-        if(emitted.MaxComponent() > 0) {
-            if(is_specular && Dot(hr.normal, cur_ray.direction) < 0) {
-                col += throughput*emitted;
-            }
-            break;
+    Vec3 emitted = hr->material->Emitted(*hr);
+    if(emitted.MaxComponent() > 0) {
+        if(path->is_specular && Dot(hr->normal, path->ray.direction) < 0) {
+            path->col += path->throughput*emitted;
         }
+        return false;
+    }
 
-        ONB onb(hr.normal);
-        Vec3 wo = onb.WorldToLocal(Normalized(-cur_ray.direction));
-        // sample indirect lighting over the hemisphere
-        Vec3 wi = hr.material->Sample(wo, &is_specular);
-        double pdf = hr.material->Pdf(wo, wi);
-        Vec3 attenuation = hr.material->Eval(wo, wi, hr);
+    ONB onb(hr->normal);
+    Vec3 wo = onb.WorldToLocal(Normalized(-path->ray.direction));
+    // sample indirect lighting over the hemisphere
+    Vec3 wi = hr->material->Sample(wo, &path->is_specular);
+    double pdf = hr->material->Pdf(wo, wi);
+    Vec3 attenuation = hr->material->Eval(wo, wi, *hr);
 
-        if(!is_specular) {
-            col += throughput*SampleOneLight(scene, onb, hr, wo);
-            if(pdf < M_EPS) break;
-            throughput = throughput*attenuation*fabs(wi.z) / pdf;
-        }
-        else throughput = throughput*attenuation;
+    if(!path->is_specular) {
+        if(SampleOneLight(scene, onb, *hr, wo, shadow_ray)) shadow_ray->contribution = path->throughput*shadow_ray->contribution;
+        if(pdf < M_EPS) return false;
+        path->throughput = path->throughput*attenuation*fabs(wi.z) / pdf;
+    }
+    else path->throughput = path->throughput*attenuation;
 
-        cur_ray = Ray(hr.position, onb.LocalToWorld(wi));
+    path->ray = Ray(hr->position, onb.LocalToWorld(wi));
 
-        // russian roulette
-        if(num_bounces >= min_bounces) {
-            double prob = throughput.MaxComponent();
-            if(RandomUniform() > prob) break;
-            throughput /= prob;
-        }
+    // russian roulette
+    if(path->num_bounces++ >= min_bounces) {
+        double prob = path->throughput.MaxComponent();
+        if(RandomUniform() > prob) return false;
+        path->throughput /= prob;
+    }
+    return true;
+}
+
+Vec3 Sample(Scene* scene, const Ray& ray, int min_bounces, int max_bounces)
+{
+    Hit hit;
+    scene->Intersect(ray, &hit, RayType::CAMERA);
+    return Sample(scene, ray, hit, min_bounces, max_bounces);
+}
+
+Vec3 Sample(Scene* scene, const Ray& ray, const Hit& first_hit, int min_bounces, int max_bounces)
+{
+    PathState path(ray);
+    Hit hit = first_hit;
+    while(path.num_bounces < max_bounces) {
+        if(path.num_bounces > 0) hit = Hit(), scene->Intersect(path.ray, &hit);
+        HitRecord hr;
+        if(hit.s != nullptr) hr = hit.GetRecord(path.ray);
+        ShadowRay shadow_ray;
+        bool alive = ShadeHit(scene, &path, hit.s != nullptr ? &hr : nullptr, &shadow_ray, min_bounces);
+        if(shadow_ray.Contributes() && !scene->Occluded(shadow_ray.ray, shadow_ray.tmax)) path.col += shadow_ray.contribution;
+        if(!alive) break;
     }
-    return col;
+    return path.col;
 }
 
 Vec3 SampleAO(Scene* scene, const Ray& ray, int num_samples)
 {
     Hit hit;
-    if(!scene->Intersect(ray, &hit)) return SampleBackground(scene, ray);
+    if(!scene->Intersect(ray, &hit, RayType::CAMERA)) return SampleBackground(scene, ray);
     HitRecord hr = hit.GetRecord(ray);
 
     ONB onb(hr.normal);
     double occlusion = 0;
     for(int i = 0; i < num_samples; ++i) {
         Vec3 wi = CosineSampleHemisphere();
-        bool is_visible = scene->Intersect(Ray(hr.position, onb.LocalToWorld(wi)), &hit);
-        if(!is_visible) occlusion += 1;
+        if(!scene->Occluded(Ray(hr.position, onb.LocalToWorld(wi)), M_INF, RayType::AO)) occlusion += 1;
     }
     return Vec3(occlusion / num_samples);
 }
@@ -1,10 +1,141 @@
 #include "scene.h"
 
 #include "ray.h"
+#include "accelerator.h"
 #include "kdtree.h"
 #include "surface.h"
+#include "thread_pool.h"
 
-static thread_local unsigned ray_count;
+#ifdef EMBREE
+#include "mesh.h"
+#include "instance.h"
+#include "mat4.h"
+#include "hit.h"
+
+#include <math.h>
+
+// passed to the callbacks of the user geometry, which identify the rays by their id
+struct EmbreeContext {
+    RTCIntersectContext context; // first member, the callbacks cast the context pointer embree passes them back
+    const Ray* rays;
+    Hit* hits; // closest hit of each ray on user geometry
+};
+
+static void UserGeometryBounds(const RTCBoundsFunctionArguments* args)
+{
+    BBox b = ((Surface*)args->geometryUserPtr)->GetBBox();
+    RTCBounds* bounds = args->bounds_o;
+    bounds->lower_x = RoundDown(b.min_point.x), bounds->lower_y = RoundDown(b.min_point.y), bounds->lower_z = RoundDown(b.min_point.z);
+    bounds->upper_x = RoundUp(b.max_point.x), bounds->upper_y = RoundUp(b.max_point.y), bounds->upper_z = RoundUp(b.max_point.z);
+}
+
+static void UserGeometryIntersect(const RTCIntersectFunctionNArguments* args)
+{
+    const EmbreeContext* ctx = (const EmbreeContext*)args->context;
+    const Surface* s = (const Surface*)args->geometryUserPtr;
+    unsigned N = args->N;
+    RTCRayN* rays = RTCRayHitN_RayN(args->rayhit, N);
+    RTCHitN* hits = RTCRayHitN_HitN(args->rayhit, N);
+    for(unsigned i = 0; i < N; ++i) {
+        if(!args->valid[i]) continue;
+        unsigned id = RTCRayN_id(rays, N, i);
+        Hit h;
+        h.t = RTCRayN_tfar(rays, N, i);
+        if(!s->Intersect(ctx->rays[id], &h)) continue;
+        RTCRayN_tfar(rays, N, i) = float(h.t);
+        RTCHitN_geomID(hits, N, i) = args->geomID;
+        RTCHitN_primID(hits, N, i) = args->primID;
+        RTCHitN_instID(hits, N, i, 0) = args->context->instID[0];
+        ctx->hits[id] = h; // the surface computes the hit in double precision, it is recorded from here
+    }
+}
+
+static void UserGeometryOccluded(const RTCOccludedFunctionNArguments* args)
+{
+    const EmbreeContext* ctx = (const EmbreeContext*)args->context;
+    const Surface* s = (const Surface*)args->geometryUserPtr;
+    unsigned N = args->N;
+    for(unsigned i = 0; i < N; ++i) {
+        if(!args->valid[i]) continue;
+        double tmax = RTCRayN_tfar(args->ray, N, i);
+        if(s->Occludes(ctx->rays[RTCRayN_id(args->ray, N, i)], tmax)) RTCRayN_tfar(args->ray, N, i) = -INFINITY;
+    }
+}
+
+static void InitEmbreeRay(RTCRayHitN* rayhit, unsigned N, unsigned i, const Ray& r, double tmax)
+{
+    RTCRayN* ray = RTCRayHitN_RayN(rayhit, N);
+    RTCHitN* hit = RTCRayHitN_HitN(rayhit, N);
+    RTCRayN_org_x(ray, N, i) = r.origin.x, RTCRayN_org_y(ray, N, i) = r.origin.y, RTCRayN_org_z(ray, N, i) = r.origin.z;
+    RTCRayN_dir_x(ray, N, i) = r.direction.x, RTCRayN_dir_y(ray, N, i) = r.direction.y, RTCRayN_dir_z(ray, N, i) = r.direction.z;
+    RTCRayN_tnear(ray, N, i) = M_EPS;
+    RTCRayN_tfar(ray, N, i) = tmax;
+    RTCRayN_mask(ray, N, i) = -1;
+    RTCRayN_time(ray, N, i) = 0;
+    RTCRayN_flags(ray, N, i) = 0;
+    RTCRayN_id(ray, N, i) = i;
+    RTCHitN_geomID(hit, N, i) = RTC_INVALID_GEOMETRY_ID;
+    RTCHitN_instID(hit, N, i, 0) = RTC_INVALID_GEOMETRY_ID;
+}
+
+Scene::~Scene()
+{
+    if(this->embree_scene) rtcReleaseScene(this->embree_scene);
+}
+
+void Scene::BuildEmbreeScene()
+{
+    // rebuilt from scratch, the instances are cheap to rebuild and the meshes may have replaced their embree scenes
+    if(this->embree_scene) rtcReleaseScene(this->embree_scene);
+    this->embree_scene = rtcNewScene(device);
+    this->embree_geometries.clear();
+    for(Surface* surface : this->bounded) {
+        const Mesh* mesh = dynamic_cast<const Mesh*>(surface);
+        const Instance* instance = dynamic_cast<const Instance*>(surface);
+        if(instance) mesh = instance->GetMesh();
+        RTCGeometry geom;
+        if(mesh) {
+            geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+            rtcSetGeometryInstancedScene(geom, mesh->EmbreeScene());
+            Mat4 m = instance ? instance->Transform() : IdentityMatrix();
+            float transform[12];
+            for(int i = 0; i < 12; ++i) transform[i] = m.data[i]; // the first three rows
+            rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT3X4_ROW_MAJOR, transform);
+        }
+        else {
+            geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_USER);
+            rtcSetGeometryUserPrimitiveCount(geom, 1);
+            rtcSetGeometryUserData(geom, surface);
+            rtcSetGeometryBoundsFunction(geom, UserGeometryBounds, nullptr);
+            rtcSetGeometryIntersectFunction(geom, UserGeometryIntersect);
+            rtcSetGeometryOccludedFunction(geom, UserGeometryOccluded);
+        }
+        rtcCommitGeometry(geom);
+        unsigned id = rtcAttachGeometry(this->embree_scene, geom);
+        rtcReleaseGeometry(geom);
+        if(id >= this->embree_geometries.size()) this->embree_geometries.resize(id + 1);
+        this->embree_geometries[id] = { mesh, instance };
+    }
+    rtcCommitScene(this->embree_scene);
+}
+
+bool Scene::RecordEmbreeHit(RTCRayHitN* rayhit, unsigned N, unsigned i, const Hit* user_hits, Hit* h) const
+{
+    RTCRayN* ray = RTCRayHitN_RayN(rayhit, N);
+    RTCHitN* hit = RTCRayHitN_HitN(rayhit, N);
+    unsigned geom_id = RTCHitN_geomID(hit, N, i), inst_id = RTCHitN_instID(hit, N, i, 0);
+    if(geom_id == RTC_INVALID_GEOMETRY_ID) return false;
+    if(inst_id == RTC_INVALID_GEOMETRY_ID) {
+        *h = user_hits[i];
+        return true;
+    }
+    // a triangle of an instanced mesh
+    const EmbreeGeometry& g = this->embree_geometries[inst_id];
+    h->RecordHit(RTCRayN_tfar(ray, N, i), g.mesh, RTCHitN_primID(hit, N, i), RTCHitN_u(hit, N, i), RTCHitN_v(hit, N, i));
+    h->instance = g.instance;
+    return true;
+}
+#endif
 
 void Scene::Add(Surface* s)
 {
@@ -17,26 +148,118 @@ void Scene::Add(std::shared_ptr<Surface> s)
     this->Add(s.get());
 }
 
-bool Scene::Intersect(const Ray& r, Hit* h)
+bool Scene::Intersect(const Ray& r, Hit* h, RayType type)
+{
+    ThreadRayStats().rays[int(type)]++;
+#ifdef EMBREE
+    Hit user_hit;
+    EmbreeContext ctx;
+    rtcInitIntersectContext(&ctx.context);
+    ctx.rays = &r, ctx.hits = &user_hit;
+    RTCRayHit rayhit;
+    InitEmbreeRay((RTCRayHitN*)&rayhit, 1, 0, r, h->t);
+    rtcIntersect1(this->embree_scene, &ctx.context, &rayhit);
+    bool hit = this->RecordEmbreeHit((RTCRayHitN*)&rayhit, 1, 0, &user_hit, h);
+#else
+    bool hit = this->tree && this->tree->Intersect(r, h);
+#endif
+    for(Surface* s : this->unbounded) hit |= s->Intersect(r, h);
+    return hit;
+}
+
+bool Scene::Occluded(const Ray& r, double tmax, RayType type)
+{
+    ThreadRayStats().rays[int(type)]++;
+    for(Surface* s : this->unbounded) {
+        if(s->Occludes(r, tmax)) return true;
+    }
+#ifdef EMBREE
+    EmbreeContext ctx;
+    rtcInitIntersectContext(&ctx.context);
+    ctx.rays = &r, ctx.hits = nullptr;
+    RTCRayHit rayhit;
+    InitEmbreeRay((RTCRayHitN*)&rayhit, 1, 0, r, tmax);
+    rtcOccluded1(this->embree_scene, &ctx.context, &rayhit.ray);
+    return rayhit.ray.tfar < 0; // embree sets tfar to -inf when the ray is occluded
+#else
+    return this->tree && this->tree->IntersectAny(r, tmax);
+#endif
+}
+
+bool Scene::SurfacesChanged()
+{
+    bool changed = false;
+    for(size_t i = 0; i < this->bounded.size(); ++i) {
+        BBox b = this->bounded[i]->GetBBox();
+        const BBox& old = this->surface_bounds[i];
+        if(!(b.min_point == old.min_point && b.max_point == old.max_point)) this->surface_bounds[i] = b, changed = true;
+    }
+    return changed;
+}
+
+void Scene::IntersectPacket(const RayPacket& p, Hit* hits, RayType type)
 {
-    ray_count++;
-    return this->tree->Intersect(r, h);
+    ThreadRayStats().rays[int(type)] += p.size;
+#ifdef EMBREE
+    static_assert(RAY_PACKET_SIZE == 8, "packets are traced with rtcIntersect8");
+    Hit user_hits[RAY_PACKET_SIZE];
+    EmbreeContext ctx;
+    rtcInitIntersectContext(&ctx.context);
+    ctx.rays = p.rays, ctx.hits = user_hits;
+    alignas(32) int valid[RAY_PACKET_SIZE];
+    alignas(32) RTCRayHit8 rayhit;
+    for(int i = 0; i < RAY_PACKET_SIZE; ++i) {
+        valid[i] = i < p.size ? -1 : 0;
+        InitEmbreeRay((RTCRayHitN*)&rayhit, RAY_PACKET_SIZE, i, p.rays[i < p.size ? i : 0], hits[i < p.size ? i : 0].t);
+    }
+    rtcIntersect8(valid, this->embree_scene, &ctx.context, &rayhit);
+    for(int i = 0; i < p.size; ++i) this->RecordEmbreeHit((RTCRayHitN*)&rayhit, RAY_PACKET_SIZE, i, user_hits, &hits[i]);
+#else
+    if(this->tree) this->tree->IntersectPacket(p, hits, p.FullMask());
+#endif
+    for(Surface* s : this->unbounded) s->IntersectPacket(p, hits, p.FullMask());
 }
 
 void Scene::Build()
 {
-    for(Surface* surface : this->surfaces) surface->Build();
-    if(this->tree == nullptr) {
-        this->tree = std::make_unique<KDTree>(this->surfaces);
+    // surfaces such as meshes build their own acceleration structures, these are independent of each other
+    TaskGroup group;
+    for(Surface* surface : this->surfaces) group.Run([surface]() { surface->Build(); });
+    group.Wait();
+    std::vector<Surface*> bounded;
+    this->unbounded.clear();
+    for(Surface* surface : this->surfaces) {
+        if(surface->GetBBox().Unbounded()) this->unbounded.push_back(surface);
+        else bounded.push_back(surface);
+    }
+#ifdef EMBREE
+    this->bounded = bounded;
+    this->BuildEmbreeScene();
+#else
+    // surfaces added since the last build can only be handled by a rebuild, moved surfaces by a refit
+    if(bounded != this->bounded) this->bounded = bounded, this->tree.reset();
+    else if(this->tree && this->SurfacesChanged() && !this->tree->Refit()) {
+        // k-d trees cannot be refit, moving surfaces are rebuilt into a bvh that later frames can refit instead
+        if(!this->accel_chosen) this->accel_type = AcceleratorType::BVH;
+        this->tree.reset();
+    }
+    if(this->tree == nullptr && !this->bounded.empty()) {
+        this->tree = BuildAccelerator(this->accel_type, this->bounded, this->kd_params);
+        this->surface_bounds.clear();
+        for(Surface* surface : this->bounded) this->surface_bounds.push_back(surface->GetBBox());
     }
+#endif
 }
 
-unsigned Scene::RayCount()
+void Scene::SetAccelerator(AcceleratorType type)
 {
-    return ray_count;
+    this->accel_type = type;
+    this->accel_chosen = true;
+    this->tree.reset(); // rebuilt with the new accelerator on the next call to Build()
 }
 
-void Scene::ResetRayCount()
+void Scene::SetKDBuildParams(const KDBuildParams& params)
 {
-    ray_count = 0;
+    this->kd_params = params;
+    this->tree.reset(); // rebuilt with the new parameters on the next call to Build()
 }
@@ -7,6 +7,11 @@
 #include <math.h>
 
 Sphere::Sphere(Vec3 centre, double radius, Material* material)
+    : Sphere(centre, radius, std::shared_ptr<Material>(material))
+{
+}
+
+Sphere::Sphere(Vec3 centre, double radius, std::shared_ptr<Material> material)
     : centre(centre), radius(radius), material(material)
 {
     Vec3 min_point = {centre.x - radius, centre.y - radius, centre.z - radius};
@@ -0,0 +1,57 @@
+#include "stats.h"
+
+static const char* RAY_TYPE_NAMES[NUM_RAY_TYPES] = { "camera", "extension", "shadow", "ao" };
+
+static thread_local RayStats thread_stats;
+
+RayStats& ThreadRayStats()
+{
+    return thread_stats;
+}
+
+TraversalCounter::~TraversalCounter()
+{
+    RayStats& stats = thread_stats;
+    stats.nodes_visited += this->nodes_visited;
+    stats.primitives_tested += this->primitives_tested;
+    stats.mailbox_hits += this->mailbox_hits;
+}
+
+uint64_t RayStats::TotalRays() const
+{
+    uint64_t total = 0;
+    for(uint64_t n : this->rays) total += n;
+    return total;
+}
+
+RayStats& RayStats::operator+=(const RayStats& s)
+{
+    for(int i = 0; i < NUM_RAY_TYPES; ++i) this->rays[i] += s.rays[i];
+    this->nodes_visited += s.nodes_visited;
+    this->primitives_tested += s.primitives_tested;
+    this->mailbox_hits += s.mailbox_hits;
+    this->shading_calls += s.shading_calls;
+    return *this;
+}
+
+void RayStats::Print() const
+{
+    double total = this->TotalRays() > 0 ? double(this->TotalRays()) : 1.0;
+    printf("rays:");
+    for(int i = 0; i < NUM_RAY_TYPES; ++i) printf(" %s %llu", RAY_TYPE_NAMES[i], (unsigned long long)this->rays[i]);
+    printf(" | per ray: %.1f nodes, %.1f primitives, %.2f mailbox hits | %llu shading calls\n",
+           this->nodes_visited / total, this->primitives_tested / total, this->mailbox_hits / total,
+           (unsigned long long)this->shading_calls);
+}
+
+void RayStats::WriteJSON(FILE* f) const
+{
+    fprintf(f, "{\"rays\": {");
+    for(int i = 0; i < NUM_RAY_TYPES; ++i) {
+        fprintf(f, "%s\"%s\": %llu", i > 0 ? ", " : "", RAY_TYPE_NAMES[i], (unsigned long long)this->rays[i]);
+    }
+    fprintf(f, "}, \"total_rays\": %llu, \"nodes_visited\": %llu, \"primitives_tested\": %llu, \"mailbox_hits\": %llu, "
+            "\"shading_calls\": %llu}", (unsigned long long)this->TotalRays(), (unsigned long long)this->nodes_visited,
+            (unsigned long long)this->primitives_tested, (unsigned long long)this->mailbox_hits,
+            (unsigned long long)this->shading_calls);
+}
@@ -0,0 +1,28 @@
+#include "surface.h"
+
+#include "hit.h"
+
+void Surface::IntersectPacket(const RayPacket& p, Hit* hits, unsigned mask) const
+{
+    for(int i = 0; i < p.size; ++i) {
+        if((mask >> i) & 1) this->Intersect(p.rays[i], &hits[i]);
+    }
+}
+
+void Surface::FillRecord(const Hit& h, const Vec3& p, HitRecord* hr) const
+{
+    hr->normal = this->NormalAt(p);
+    hr->material = this->MaterialAt(p);
+    hr->u = hr->v = 0.0;
+    if(hr->material && hr->material->NeedsUV()) {
+        Vec3 uv = this->UV(p);
+        hr->u = uv.u, hr->v = uv.v;
+    }
+}
+
+bool Surface::Occludes(const Ray& r, double tmax) const
+{
+    Hit h;
+    h.t = tmax;
+    return this->Intersect(r, &h);
+}
@@ -0,0 +1,165 @@
+#include "thread_pool.h"
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local int current_worker = -1;
+
+ThreadPool::ThreadPool(int num_threads, bool pin_threads)
+    : num_queued(0), stop(false)
+{
+    for(int i = 0; i <= num_threads; ++i) this->queues.push_back(std::make_unique<TaskQueue>());
+    for(int i = 0; i < num_threads; ++i) this->threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+#ifdef __linux__
+    if(pin_threads) this->PinThreads();
+#endif
+}
+
+#ifdef __linux__
+// spreads the workers over the cores the process may run on, the first one is left to the thread that created the pool
+void ThreadPool::PinThreads()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "could not pin the worker threads, the available cores are unknown: %s\n", strerror(errno));
+        return;
+    }
+    std::vector<int> cores;
+    for(int c = 0; c < CPU_SETSIZE; ++c) {
+        if(CPU_ISSET(c, &allowed)) cores.push_back(c);
+    }
+    for(int i = 0; i < this->NumThreads(); ++i) {
+        int core = cores[(i + 1) % cores.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(core, &set);
+        int err = pthread_setaffinity_np(this->threads[i].native_handle(), sizeof(set), &set);
+        if(err != 0) fprintf(stderr, "could not pin worker thread %d to core %d: %s\n", i, core, strerror(err));
+    }
+}
+#endif
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(this->sleep_mtx);
+        this->stop = true;
+    }
+    this->wake.notify_all();
+    for(auto& t : this->threads) t.join();
+}
+
+ThreadPool* ThreadPool::Global()
+{
+    static ThreadPool pool(Max(0, int(std::thread::hardware_concurrency()) - 1));
+    return &pool;
+}
+
+void ThreadPool::Submit(Task task)
+{
+    // workers push onto their own queue to keep the subtasks local, everyone else uses the shared queue
+    int queue_id = current_pool == this ? current_worker : this->NumThreads();
+    {
+        TaskQueue* q = this->queues[queue_id].get();
+        std::lock_guard<std::mutex> guard(q->mtx);
+        q->tasks.push_back(std::move(task));
+    }
+    this->num_queued++;
+    std::lock_guard<std::mutex> guard(this->sleep_mtx);
+    this->wake.notify_one();
+}
+
+int ThreadPool::WorkerIndex() const
+{
+    return current_pool == this ? current_worker : this->NumThreads();
+}
+
+bool ThreadPool::PopTask(int queue_id, Task* task)
+{
+    int num_queues = this->queues.size();
+    if(queue_id >= 0) {
+        TaskQueue* q = this->queues[queue_id].get();
+        std::lock_guard<std::mutex> guard(q->mtx);
+        if(!q->tasks.empty()) {
+            *task = std::move(q->tasks.back());
+            q->tasks.pop_back();
+            this->num_queued--;
+            return true;
+        }
+    }
+    // steal the oldest task from another queue, these tend to be the largest ones
+    int start = Max(0, queue_id + 1);
+    for(int i = 0; i < num_queues; ++i) {
+        int victim = (start + i) % num_queues;
+        if(victim == queue_id) continue;
+        TaskQueue* q = this->queues[victim].get();
+        std::lock_guard<std::mutex> guard(q->mtx);
+        if(!q->tasks.empty()) {
+            *task = std::move(q->tasks.front());
+            q->tasks.pop_front();
+            this->num_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(int worker_id)
+{
+    current_pool = this, current_worker = worker_id;
+    while(true) {
+        Task task;
+        if(this->PopTask(worker_id, &task)) {
+            task();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(this->sleep_mtx);
+        this->wake.wait(lock, [this] { return this->stop || this->num_queued > 0; });
+        if(this->stop) return;
+    }
+}
+
+bool ThreadPool::RunPendingTask()
+{
+    Task task;
+    if(!this->PopTask(current_pool == this ? current_worker : -1, &task)) return false;
+    task();
+    return true;
+}
+
+void TaskGroup::Run(Task task)
+{
+    this->num_pending++;
+    this->pool->Submit([this, task]() {
+        task();
+        this->num_pending--;
+    });
+}
+
+void TaskGroup::Wait()
+{
+    while(this->num_pending > 0) {
+        if(!this->pool->RunPendingTask()) std::this_thread::yield();
+    }
+}
+
+void ParallelFor(int begin, int end, int grain_size, const std::function<void(int, int)>& func)
+{
+    TaskGroup group;
+    for(int b = begin; b < end; b += grain_size) {
+        int e = Min(b + grain_size, end);
+        if(e == end) func(b, e); // run the last chunk on the calling thread
+        else group.Run([&func, b, e]() { func(b, e); });
+    }
+    group.Wait();
+}
@@ -0,0 +1,102 @@
+#include "tile_queue.h"
+
+#include "utils.h"
+
+#include <algorithm>
+
+// interleaves the bits of x and y
+static inline uint32_t MortonCode(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ff;
+        v = (v | (v << 4)) & 0x0f0f0f0f;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+std::vector<Tile> MortonOrderedTiles(int width, int height, int tile_size)
+{
+    int nx = (width + tile_size - 1) / tile_size, ny = (height + tile_size - 1) / tile_size;
+    std::vector<std::pair<uint32_t, Tile>> coded;
+    coded.reserve(nx*ny);
+    for(int ty = 0; ty < ny; ++ty) {
+        for(int tx = 0; tx < nx; ++tx) {
+            Tile t = { tx*tile_size, ty*tile_size, Min((tx+1)*tile_size, width), Min((ty+1)*tile_size, height) };
+            coded.push_back({ MortonCode(tx, ty), t });
+        }
+    }
+    std::sort(coded.begin(), coded.end(), [](const std::pair<uint32_t, Tile>& a, const std::pair<uint32_t, Tile>& b) {
+        return a.first < b.first;
+    });
+    std::vector<Tile> tiles;
+    tiles.reserve(coded.size());
+    for(const auto& c : coded) tiles.push_back(c.second);
+    return tiles;
+}
+
+static inline uint64_t PackRange(uint32_t begin, uint32_t end) { return (uint64_t(begin) << 32) | end; }
+
+TileQueue::TileQueue(const std::vector<Tile>& tiles, int num_threads)
+    : tiles(tiles), ranges(new Range[num_threads]), num_threads(num_threads)
+{
+    this->Reset();
+}
+
+void TileQueue::Reset()
+{
+    uint64_t n = this->tiles.size();
+    for(int i = 0; i < this->num_threads; ++i) {
+        this->ranges[i].bits = PackRange(n*i / this->num_threads, n*(i+1) / this->num_threads);
+    }
+}
+
+bool TileQueue::PopFront(int thread_id, int* index)
+{
+    std::atomic<uint64_t>& bits = this->ranges[thread_id].bits;
+    uint64_t cur = bits.load();
+    for(;;) {
+        uint32_t begin = cur >> 32, end = uint32_t(cur);
+        if(begin >= end) return false;
+        if(bits.compare_exchange_weak(cur, PackRange(begin + 1, end))) {
+            *index = begin;
+            return true;
+        }
+    }
+}
+
+bool TileQueue::PopBack(int thread_id, int* index)
+{
+    std::atomic<uint64_t>& bits = this->ranges[thread_id].bits;
+    uint64_t cur = bits.load();
+    for(;;) {
+        uint32_t begin = cur >> 32, end = uint32_t(cur);
+        if(begin >= end) return false;
+        if(bits.compare_exchange_weak(cur, PackRange(begin, end - 1))) {
+            *index = end - 1;
+            return true;
+        }
+    }
+}
+
+bool TileQueue::Next(int thread_id, Tile* tile)
+{
+    int index;
+    while(!this->PopFront(thread_id, &index)) {
+        // steal from the thread with the most tiles left, the range can be emptied by others in the meantime
+        int victim = -1;
+        uint32_t most = 0;
+        for(int i = 0; i < this->num_threads; ++i) {
+            uint64_t cur = this->ranges[i].bits.load(std::memory_order_relaxed);
+            uint32_t begin = cur >> 32, end = uint32_t(cur);
+            if(end > begin && end - begin > most) victim = i, most = end - begin;
+        }
+        if(victim < 0) return false;
+        if(this->PopBack(victim, &index)) break;
+    }
+    *tile = this->tiles[index];
+    return true;
+}
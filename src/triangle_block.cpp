@@ -0,0 +1,219 @@
+#include "triangle_block.h"
+
+#include "mesh.h"
+#include "hit.h"
+#include "ray.h"
+#include "utils.h"
+
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+void TriangleBlocks::Assign(const std::vector<int>& block_faces)
+{
+    this->blocks.resize(block_faces.size() / TRIANGLE_BLOCK_SIZE);
+    for(unsigned i = 0; i < this->blocks.size(); ++i) {
+        for(int j = 0; j < TRIANGLE_BLOCK_SIZE; ++j) this->blocks[i].faces[j] = block_faces[TRIANGLE_BLOCK_SIZE*i + j];
+    }
+    this->Update();
+}
+
+void TriangleBlocks::Update()
+{
+    for(unsigned i = 0; i < this->blocks.size(); ++i) {
+        TriangleBlock& b = this->blocks[i];
+        BBox bbox = this->Bounds(i);
+        Vec3 size = bbox.Size(), centre = bbox.Anchor(Vec3(0.5));
+        b.anchor[0] = centre.x, b.anchor[1] = centre.y, b.anchor[2] = centre.z;
+        b.extent = size.MaxComponent();
+        Vec3 anchor(b.anchor[0], b.anchor[1], b.anchor[2]);
+        for(int j = 0; j < TRIANGLE_BLOCK_SIZE; ++j) {
+            Vec3 a(0), e1(0), e2(0);
+            if(b.faces[j] >= 0) {
+                const int* v = &this->mesh->indices[3*b.faces[j]];
+                const Vec3& p0 = this->mesh->positions[v[0]];
+                const Vec3& p1 = this->mesh->positions[v[1]];
+                const Vec3& p2 = this->mesh->positions[v[2]];
+                a = p0 - anchor, e1 = p1 - p0, e2 = p2 - p0;
+            }
+            b.v0[0][j] = a.x, b.v0[1][j] = a.y, b.v0[2][j] = a.z;
+            b.e1[0][j] = e1.x, b.e1[1][j] = e1.y, b.e1[2][j] = e1.z;
+            b.e2[0][j] = e2.x, b.e2[1][j] = e2.y, b.e2[2][j] = e2.z;
+        }
+    }
+}
+
+BBox TriangleBlocks::Bounds(int i) const
+{
+    const int* faces = this->blocks[i].faces;
+    BBox bbox = this->mesh->TriangleBBox(faces[0]);
+    for(int j = 1; j < TRIANGLE_BLOCK_SIZE && faces[j] >= 0; ++j) {
+        bbox = bbox.Union(this->mesh->TriangleBBox(faces[j]));
+    }
+    return bbox;
+}
+
+// moves the ray origin along the ray to the point closest to the block, so that the single precision values and the
+// errors of the distances stay small. tmin/tmax bound the distances of the candidates from the moved origin
+static inline void ShiftRay(const TriangleBlock& b, const Ray& r, double tmax, float o[3], float* tmin_f, float* tmax_f)
+{
+    const Vec3& d = r.direction;
+    double dd = Dot(d, d);
+    Vec3 anchor(b.anchor[0], b.anchor[1], b.anchor[2]);
+    double t_offset = Dot(anchor - r.origin, d) / dd;
+    Vec3 shifted = r.origin + t_offset*d - anchor;
+    // the rounding errors of the distance grow with the magnitude of the values involved
+    double slack = TRIANGLE_BLOCK_EPS*(Abs(shifted).MaxComponent() + b.extent) / sqrt(dd);
+    o[0] = float(shifted.x), o[1] = float(shifted.y), o[2] = float(shifted.z);
+    *tmin_f = float(M_EPS - t_offset - slack), *tmax_f = float(tmax - t_offset + slack);
+}
+
+#ifdef __SSE__
+// widened moller-trumbore on four ray/triangle pairs at once, returns the lanes that may hit
+static inline __m128 TestLanes(const __m128 o[3], const __m128 d[3], const __m128 v0[3], const __m128 e1[3],
+                               const __m128 e2[3], __m128 tmin, __m128 tmax)
+{
+    // p = d x e2, det = e1 . p
+    __m128 px = _mm_sub_ps(_mm_mul_ps(d[1], e2[2]), _mm_mul_ps(d[2], e2[1]));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(d[2], e2[0]), _mm_mul_ps(d[0], e2[2]));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(d[0], e2[1]), _mm_mul_ps(d[1], e2[0]));
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], px), _mm_mul_ps(e1[1], py)), _mm_mul_ps(e1[2], pz));
+    __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 mask = _mm_cmpgt_ps(abs_det, _mm_set1_ps(1e-30f));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    // t = o - v0, u = (t . p) / det
+    __m128 tx = _mm_sub_ps(o[0], v0[0]), ty = _mm_sub_ps(o[1], v0[1]), tz = _mm_sub_ps(o[2], v0[2]);
+    __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+    // q = t x e1, v = (d . q) / det, dist = (e2 . q) / det
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1[2]), _mm_mul_ps(tz, e1[1]));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1[0]), _mm_mul_ps(tx, e1[2]));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1[1]), _mm_mul_ps(ty, e1[0]));
+    __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], qx), _mm_mul_ps(d[1], qy)), _mm_mul_ps(d[2], qz)), inv_det);
+    __m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], qx), _mm_mul_ps(e2[1], qy)), _mm_mul_ps(e2[2], qz)), inv_det);
+    const __m128 lo = _mm_set1_ps(-TRIANGLE_BLOCK_EPS), hi = _mm_set1_ps(1.0f + TRIANGLE_BLOCK_EPS);
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, lo), _mm_cmpge_ps(v, lo)));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), hi));
+    return _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(dist, tmin), _mm_cmple_ps(dist, tmax)));
+}
+#endif
+
+// tests the ray against all triangles of the block in single precision, returns a bitmask of the triangles that may
+// be hit within (M_EPS, tmax]
+unsigned TriangleBlocks::Candidates(const TriangleBlock& b, const Ray& r, double tmax) const
+{
+    float o[3], tmin_f, tmax_f;
+    ShiftRay(b, r, tmax, o, &tmin_f, &tmax_f);
+    const Vec3& d = r.direction;
+#ifdef __SSE__
+    const __m128 ray_o[3] = { _mm_set1_ps(o[0]), _mm_set1_ps(o[1]), _mm_set1_ps(o[2]) };
+    const __m128 ray_d[3] = { _mm_set1_ps(d.x), _mm_set1_ps(d.y), _mm_set1_ps(d.z) };
+    const __m128 v0[3] = { _mm_load_ps(b.v0[0]), _mm_load_ps(b.v0[1]), _mm_load_ps(b.v0[2]) };
+    const __m128 e1[3] = { _mm_load_ps(b.e1[0]), _mm_load_ps(b.e1[1]), _mm_load_ps(b.e1[2]) };
+    const __m128 e2[3] = { _mm_load_ps(b.e2[0]), _mm_load_ps(b.e2[1]), _mm_load_ps(b.e2[2]) };
+    __m128 mask = TestLanes(ray_o, ray_d, v0, e1, e2, _mm_set1_ps(tmin_f), _mm_set1_ps(tmax_f));
+    return unsigned(_mm_movemask_ps(mask));
+#else
+    unsigned mask = 0;
+    float dxyz[3] = { float(d.x), float(d.y), float(d.z) };
+    for(int i = 0; i < TRIANGLE_BLOCK_SIZE; ++i) {
+        float px = dxyz[1]*b.e2[2][i] - dxyz[2]*b.e2[1][i];
+        float py = dxyz[2]*b.e2[0][i] - dxyz[0]*b.e2[2][i];
+        float pz = dxyz[0]*b.e2[1][i] - dxyz[1]*b.e2[0][i];
+        float det = b.e1[0][i]*px + b.e1[1][i]*py + b.e1[2][i]*pz;
+        if(fabsf(det) <= 1e-30f) continue;
+        float inv_det = 1.0f / det;
+        float tx = o[0] - b.v0[0][i], ty = o[1] - b.v0[1][i], tz = o[2] - b.v0[2][i];
+        float u = (tx*px + ty*py + tz*pz)*inv_det;
+        float qx = ty*b.e1[2][i] - tz*b.e1[1][i];
+        float qy = tz*b.e1[0][i] - tx*b.e1[2][i];
+        float qz = tx*b.e1[1][i] - ty*b.e1[0][i];
+        float v = (dxyz[0]*qx + dxyz[1]*qy + dxyz[2]*qz)*inv_det;
+        float dist = (b.e2[0][i]*qx + b.e2[1][i]*qy + b.e2[2][i]*qz)*inv_det;
+        if(u < -TRIANGLE_BLOCK_EPS || v < -TRIANGLE_BLOCK_EPS || u + v > 1.0f + TRIANGLE_BLOCK_EPS) continue;
+        if(dist < tmin_f || dist > tmax_f) continue;
+        mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+bool TriangleBlocks::Intersect(int i, const Ray& r, Hit* h) const
+{
+    const TriangleBlock& b = this->blocks[i];
+    bool hit = false;
+    for(unsigned mask = this->Candidates(b, r, h->t); mask; mask &= mask - 1) {
+        hit |= this->mesh->IntersectTriangle(b.faces[__builtin_ctz(mask)], r, h);
+    }
+    return hit;
+}
+
+bool TriangleBlocks::Occludes(int i, const Ray& r, double tmax) const
+{
+    const TriangleBlock& b = this->blocks[i];
+    for(unsigned mask = this->Candidates(b, r, tmax); mask; mask &= mask - 1) {
+        Hit h;
+        h.t = tmax;
+        if(this->mesh->IntersectTriangle(b.faces[__builtin_ctz(mask)], r, &h)) return true;
+    }
+    return false;
+}
+
+// each triangle of the block is tested against four rays of the packet at once, so its vertex data is loaded once for
+// the whole packet. the candidates of every ray are then decided by the double precision test as in Intersect
+void TriangleBlocks::IntersectPacket(int i, const RayPacket& p, Hit* hits, unsigned mask) const
+{
+#ifdef __SSE__
+    const TriangleBlock& b = this->blocks[i];
+    // testing the triangles one by one against four rays pays off only if enough rays are active
+    int num_triangles = 0, num_halves = ((mask & 0xf) != 0) + ((mask >> 4) != 0);
+    while(num_triangles < TRIANGLE_BLOCK_SIZE && b.faces[num_triangles] >= 0) num_triangles++;
+    if(__builtin_popcount(mask) <= num_triangles*num_halves) {
+        for(; mask; mask &= mask - 1) {
+            int k = __builtin_ctz(mask);
+            this->Intersect(i, p.rays[k], &hits[k]);
+        }
+        return;
+    }
+    // the moved rays as structure of arrays, inactive lanes get an empty distance range
+    alignas(16) float o[3][RAY_PACKET_SIZE], d[3][RAY_PACKET_SIZE], tmin[RAY_PACKET_SIZE], tmax[RAY_PACKET_SIZE];
+    for(int k = 0; k < RAY_PACKET_SIZE; ++k) {
+        if(mask & (1u << k)) {
+            float ok[3];
+            ShiftRay(b, p.rays[k], hits[k].t, ok, &tmin[k], &tmax[k]);
+            const Vec3& dk = p.rays[k].direction;
+            for(int a = 0; a < 3; ++a) o[a][k] = ok[a];
+            d[0][k] = float(dk.x), d[1][k] = float(dk.y), d[2][k] = float(dk.z);
+        }
+        else {
+            for(int a = 0; a < 3; ++a) o[a][k] = d[a][k] = 0.0f;
+            tmin[k] = 1.0f, tmax[k] = -1.0f;
+        }
+    }
+    unsigned candidates[TRIANGLE_BLOCK_SIZE] = {};
+    for(int j = 0; j < num_triangles; ++j) {
+        const __m128 v0[3] = { _mm_set1_ps(b.v0[0][j]), _mm_set1_ps(b.v0[1][j]), _mm_set1_ps(b.v0[2][j]) };
+        const __m128 e1[3] = { _mm_set1_ps(b.e1[0][j]), _mm_set1_ps(b.e1[1][j]), _mm_set1_ps(b.e1[2][j]) };
+        const __m128 e2[3] = { _mm_set1_ps(b.e2[0][j]), _mm_set1_ps(b.e2[1][j]), _mm_set1_ps(b.e2[2][j]) };
+        for(int k = 0; k < RAY_PACKET_SIZE; k += 4) {
+            if(((mask >> k) & 0xf) == 0) continue;
+            const __m128 ray_o[3] = { _mm_load_ps(&o[0][k]), _mm_load_ps(&o[1][k]), _mm_load_ps(&o[2][k]) };
+            const __m128 ray_d[3] = { _mm_load_ps(&d[0][k]), _mm_load_ps(&d[1][k]), _mm_load_ps(&d[2][k]) };
+            __m128 lanes = TestLanes(ray_o, ray_d, v0, e1, e2, _mm_load_ps(&tmin[k]), _mm_load_ps(&tmax[k]));
+            candidates[j] |= unsigned(_mm_movemask_ps(lanes)) << k;
+        }
+    }
+    for(int j = 0; j < TRIANGLE_BLOCK_SIZE; ++j) {
+        for(unsigned rays = candidates[j]; rays; rays &= rays - 1) {
+            int k = __builtin_ctz(rays);
+            this->mesh->IntersectTriangle(b.faces[j], p.rays[k], &hits[k]);
+        }
+    }
+#else
+    for(; mask; mask &= mask - 1) {
+        int k = __builtin_ctz(mask);
+        this->Intersect(i, p.rays[k], &hits[k]);
+    }
+#endif
+}
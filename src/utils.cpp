@@ -6,9 +6,26 @@
 #include <random>
 #include <math.h>
 
+float RoundDown(double x)
+{
+    float f = float(x);
+    return f > x ? nextafterf(f, -INFINITY) : f;
+}
+
+float RoundUp(double x)
+{
+    float f = float(x);
+    return f < x ? nextafterf(f, INFINITY) : f;
+}
+
 static thread_local std::random_device rd;
 static thread_local std::mt19937 rng(rd());
 
+void SeedRandom(unsigned seed)
+{
+    rng.seed(seed);
+}
+
 double RandomUniform(double a, double b)
 {
     std::uniform_real_distribution<double> uniform_dist(a, b);
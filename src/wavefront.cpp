@@ -0,0 +1,79 @@
+#include "wavefront.h"
+
+#include "scene.h"
+#include "ray.h"
+#include "material.h"
+
+#include <algorithm>
+#include <numeric>
+
+WavefrontIntegrator::WavefrontIntegrator(Scene* scene, int min_bounces, int max_bounces)
+    : scene(scene), min_bounces(min_bounces), max_bounces(max_bounces)
+{
+}
+
+void WavefrontIntegrator::Extend(RayType type)
+{
+    int n = this->active.size();
+    for(int begin = 0; begin < n; begin += RAY_PACKET_SIZE) {
+        RayPacket packet;
+        packet.size = Min(RAY_PACKET_SIZE, n - begin);
+        Hit packet_hits[RAY_PACKET_SIZE];
+        for(int i = 0; i < packet.size; ++i) packet.rays[i] = this->paths[this->active[begin + i]].ray;
+        this->scene->IntersectPacket(packet, packet_hits, type);
+        for(int i = 0; i < packet.size; ++i) {
+            int path_idx = this->active[begin + i];
+            this->hits[path_idx] = packet_hits[i];
+            if(packet_hits[i].s != nullptr) this->records[path_idx] = packet_hits[i].GetRecord(packet.rays[i]);
+        }
+    }
+}
+
+void WavefrontIntegrator::Shade()
+{
+    // paths with the same material are shaded back to back, misses go first
+    std::stable_sort(this->active.begin(), this->active.end(), [&](int a, int b) {
+        const Material* ma = this->hits[a].s != nullptr ? this->records[a].material : nullptr;
+        const Material* mb = this->hits[b].s != nullptr ? this->records[b].material : nullptr;
+        return ma < mb;
+    });
+    for(int path_idx : this->active) {
+        const HitRecord* hr = this->hits[path_idx].s != nullptr ? &this->records[path_idx] : nullptr;
+        PathState* path = &this->paths[path_idx];
+        bool alive = ShadeHit(this->scene, path, hr, &this->shadow_rays[path_idx], this->min_bounces);
+        this->alive[path_idx] = alive && path->num_bounces < this->max_bounces;
+    }
+}
+
+void WavefrontIntegrator::TraceShadowRays()
+{
+    for(int path_idx : this->active) {
+        const ShadowRay& shadow_ray = this->shadow_rays[path_idx];
+        if(shadow_ray.Contributes() && !this->scene->Occluded(shadow_ray.ray, shadow_ray.tmax)) {
+            this->paths[path_idx].col += shadow_ray.contribution;
+        }
+    }
+}
+
+void WavefrontIntegrator::Trace(const std::vector<Ray>& rays, std::vector<Vec3>* cols)
+{
+    int n = rays.size();
+    this->paths.clear();
+    for(const Ray& r : rays) this->paths.emplace_back(r);
+    this->hits.resize(n);
+    this->records.resize(n);
+    this->shadow_rays.resize(n);
+    this->alive.resize(n);
+    this->active.resize(n);
+    std::iota(this->active.begin(), this->active.end(), 0);
+    for(int bounce = 0; !this->active.empty(); ++bounce) {
+        this->Extend(bounce == 0 ? RayType::CAMERA : RayType::EXTENSION);
+        this->Shade();
+        this->TraceShadowRays();
+        // the surviving paths keep their order, which keeps paths of the same material together for the next bounce
+        auto end = std::remove_if(this->active.begin(), this->active.end(), [&](int path_idx) { return !this->alive[path_idx]; });
+        this->active.erase(end, this->active.end());
+    }
+    cols->resize(n);
+    for(int i = 0; i < n; ++i) (*cols)[i] = this->paths[i].col;
+}